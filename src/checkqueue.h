@@ -51,6 +51,10 @@ private:
     //! The temporary evaluation result.
     bool fAllOk;
 
+    //! The first check found to fail since the last Wait, so its error can be reported. Checks
+    //! run out of order, so this is not necessarily the earliest one added that fails.
+    T checkFailed;
+
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are not anymore in queue, but still in
@@ -65,11 +69,12 @@ private:
     unsigned int nBatchSize;
 
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(bool fMaster = false, T* pfailed = NULL)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
+        T checkLocalFailed;
         unsigned int nNow = 0;
         bool fOk = true;
         do {
@@ -77,6 +82,9 @@ private:
                 boost::unique_lock<boost::mutex> lock(mutex);
                 // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
                 if (nNow) {
+                    if (!fOk && fAllOk)
+                        // the first failure; later ones were skipped or are not reported
+                        checkFailed.swap(checkLocalFailed);
                     fAllOk &= fOk;
                     nTodo -= nNow;
                     if (nTodo == 0 && !fMaster)
@@ -92,8 +100,12 @@ private:
                         nTotal--;
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
+                        if (fMaster) {
                             fAllOk = true;
+                            if (pfailed)
+                                pfailed->swap(checkFailed);
+                            T().swap(checkFailed);
+                        }
                         // return the current status
                         return fRet;
                     }
@@ -118,14 +130,21 @@ private:
                 fOk = fAllOk;
             }
             // execute work
-            for (T& check : vChecks)
-                if (fOk)
+            for (T& check : vChecks) {
+                if (fOk) {
                     fOk = check();
+                    if (!fOk)
+                        checkLocalFailed.swap(check);
+                }
+            }
             vChecks.clear();
         } while (true);
     }
 
 public:
+    //! Mutex to ensure only one CCheckQueueControl uses the queue at a time
+    boost::mutex ControlMutex;
+
     //! Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
@@ -136,9 +155,10 @@ public:
     }
 
     //! Wait until execution finishes, and return whether all evaluations where successful.
-    bool Wait()
+    //! On failure, pfailed (if not NULL) receives the first check found to fail.
+    bool Wait(T* pfailed = NULL)
     {
-        return Loop(true);
+        return Loop(true, pfailed);
     }
 
     //! Add a batch of checks to the queue
@@ -169,7 +189,8 @@ public:
 
 /**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
- * queue is finished before continuing.
+ * queue is finished before continuing. Controllers of the same queue are
+ * serialized: a second one blocks until the first is destroyed.
  */
 template <typename T>
 class CCheckQueueControl
@@ -181,18 +202,19 @@ private:
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
-        // passed queue is supposed to be unused, or NULL
+        // passed queue is supposed to be unused once we own it, or NULL
         if (pqueue != NULL) {
+            pqueue->ControlMutex.lock();
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
         }
     }
 
-    bool Wait()
+    bool Wait(T* pfailed = NULL)
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(pfailed);
         fDone = true;
         return fRet;
     }
@@ -207,6 +229,8 @@ public:
     {
         if (!fDone)
             Wait();
+        if (pqueue != NULL)
+            pqueue->ControlMutex.unlock();
     }
 };
 
@@ -27,10 +27,40 @@ bool CKeyStore::AddKey(const CKey& key)
     return AddKeyPubKey(key, key.GetPubKey());
 }
 
+void CBasicKeyStore::AddScriptPubKey(const CScript& scriptPubKey)
+{
+    AssertLockHeld(cs_KeyStore);
+    mapScriptPubKeys[scriptPubKey]++;
+}
+
+void CBasicKeyStore::RemoveScriptPubKey(const CScript& scriptPubKey)
+{
+    AssertLockHeld(cs_KeyStore);
+    ScriptPubKeyMap::iterator it = mapScriptPubKeys.find(scriptPubKey);
+    if (it != mapScriptPubKeys.end() && --it->second == 0)
+        mapScriptPubKeys.erase(it);
+}
+
+void CBasicKeyStore::AddScriptPubKeysForKey(const CPubKey& pubkey)
+{
+    AddScriptPubKey(GetScriptForDestination(pubkey.GetID()));
+    AddScriptPubKey(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+}
+
+bool CBasicKeyStore::HaveScriptPubKey(const CScript& scriptPubKey) const
+{
+    LOCK(cs_KeyStore);
+    return mapScriptPubKeys.count(scriptPubKey) > 0;
+}
+
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey& pubkey)
 {
     LOCK(cs_KeyStore);
-    mapKeys[pubkey.GetID()] = key;
+    std::pair<KeyMap::iterator, bool> ret = mapKeys.insert(std::make_pair(pubkey.GetID(), key));
+    if (ret.second)
+        AddScriptPubKeysForKey(pubkey);
+    else
+        ret.first->second = key;
     return true;
 }
 
@@ -40,7 +70,10 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
         return error("CBasicKeyStore::AddCScript() : redeemScripts > %i bytes are invalid", MAX_SCRIPT_ELEMENT_SIZE);
 
     LOCK(cs_KeyStore);
-    mapScripts[CScriptID(redeemScript)] = redeemScript;
+    CScriptID scriptID(redeemScript);
+    if (!mapScripts.count(scriptID))
+        AddScriptPubKey(GetScriptForDestination(scriptID));
+    mapScripts[scriptID] = redeemScript;
     return true;
 }
 
@@ -64,14 +97,16 @@ bool CBasicKeyStore::GetCScript(const CScriptID& hash, CScript& redeemScriptOut)
 bool CBasicKeyStore::AddWatchOnly(const CScript& dest)
 {
     LOCK(cs_KeyStore);
-    setWatchOnly.insert(dest);
+    if (setWatchOnly.insert(dest).second)
+        AddScriptPubKey(dest);
     return true;
 }
 
 bool CBasicKeyStore::RemoveWatchOnly(const CScript& dest)
 {
     LOCK(cs_KeyStore);
-    setWatchOnly.erase(dest);
+    if (setWatchOnly.erase(dest))
+        RemoveScriptPubKey(dest);
     return true;
 }
 
@@ -90,14 +125,16 @@ bool CBasicKeyStore::HaveWatchOnly() const
 bool CBasicKeyStore::AddMultiSig(const CScript& dest)
 {
     LOCK(cs_KeyStore);
-    setMultiSig.insert(dest);
+    if (setMultiSig.insert(dest).second)
+        AddScriptPubKey(dest);
     return true;
 }
 
 bool CBasicKeyStore::RemoveMultiSig(const CScript& dest)
 {
     LOCK(cs_KeyStore);
-    setMultiSig.erase(dest);
+    if (setMultiSig.erase(dest))
+        RemoveScriptPubKey(dest);
     return true;
 }
 
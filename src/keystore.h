@@ -8,12 +8,14 @@
 
 #include "key.h"
 #include "pubkey.h"
+#include "script/script.h"
 #include "sync.h"
 
+#include <boost/functional/hash.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/variant.hpp>
 
-class CScript;
 class CScriptID;
 
 /** A virtual base class for key stores */
@@ -51,12 +53,24 @@ public:
     virtual bool RemoveMultiSig(const CScript& dest) = 0;
     virtual bool HaveMultiSig(const CScript& dest) const = 0;
     virtual bool HaveMultiSig() const = 0;
+
+    //! Whether scriptPubKey is a standard output script for one of the keys, redeem scripts,
+    //! watch-only or multisig entries in the store. Used by IsMine to reject foreign scripts quickly.
+    virtual bool HaveScriptPubKey(const CScript& scriptPubKey) const = 0;
+};
+
+struct CScriptHasher {
+    size_t operator()(const CScript& script) const
+    {
+        return boost::hash_range(script.begin(), script.end());
+    }
 };
 
 typedef std::map<CKeyID, CKey> KeyMap;
 typedef std::map<CScriptID, CScript> ScriptMap;
 typedef std::set<CScript> WatchOnlySet;
 typedef std::set<CScript> MultiSigScriptSet;
+typedef boost::unordered_map<CScript, unsigned int, CScriptHasher> ScriptPubKeyMap;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
@@ -67,6 +81,12 @@ protected:
     WatchOnlySet setWatchOnly;
     MultiSigScriptSet setMultiSig;
 
+    //! Output scripts that can be ours, counted by the number of entries that produce them
+    ScriptPubKeyMap mapScriptPubKeys;
+    void AddScriptPubKey(const CScript& scriptPubKey);
+    void RemoveScriptPubKey(const CScript& scriptPubKey);
+    void AddScriptPubKeysForKey(const CPubKey& pubkey);
+
 public:
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
     bool HaveKey(const CKeyID& address) const
@@ -115,6 +135,8 @@ public:
     virtual bool RemoveMultiSig(const CScript& dest);
     virtual bool HaveMultiSig(const CScript& dest) const;
     virtual bool HaveMultiSig() const;
+
+    virtual bool HaveScriptPubKey(const CScript& scriptPubKey) const;
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
@@ -88,15 +88,27 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+struct IteratorComparator {
+    template <typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev;
+map<NodeId, set<uint256> > mapOrphanTransactionsByPeer;
+size_t nOrphanTransactionsSize = 0;
 map<uint256, int64_t> mapRejectedBlocks;
 
 
 void EraseOrphansFor(NodeId peer);
+int static EraseOrphanTx(uint256 hash);
 
 static void CheckBlockIndex();
 
@@ -599,8 +611,9 @@ CBlockTreeDB* pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
+bool AddOrphanTx(const CTransactionRef& ptx, NodeId peer)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -613,48 +626,65 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
+    if (sz > MAX_ORPHAN_TX_SIZE) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // A peer that already fills its share of the pool replaces one of its own orphans
+    set<uint256>& setPeerOrphans = mapOrphanTransactionsByPeer[peer];
+    if (setPeerOrphans.size() >= MAX_ORPHAN_TRANSACTIONS_PER_PEER) {
+        set<uint256>::iterator itPeer = setPeerOrphans.lower_bound(GetRandHash());
+        if (itPeer == setPeerOrphans.end())
+            itPeer = setPeerOrphans.begin();
+        EraseOrphanTx(*itPeer);
+    }
+
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.insert(make_pair(hash, COrphanTx{ptx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, sz})).first;
     for (const CTxIn& txin : tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(it);
+    mapOrphanTransactionsByPeer[peer].insert(hash);
+    nOrphanTransactionsSize += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
         mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+int static EraseOrphanTx(uint256 hash)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
-        return;
-    for (const CTxIn& txin : it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        return 0;
+    for (const CTxIn& txin : it->second.tx->vin) {
+        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
+        itPrev->second.erase(it);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end()) {
+        itPeer->second.erase(hash);
+        if (itPeer->second.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTransactionsSize -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
+    return 1;
 }
 
 void EraseOrphansFor(NodeId peer)
 {
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    // Copy, as erasing the last orphan removes the peer's entry
+    set<uint256> setPeerOrphans = itPeer->second;
+    for (const uint256& hash : setPeerOrphans)
+        nErased += EraseOrphanTx(hash);
     if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
@@ -662,18 +692,97 @@ void EraseOrphansFor(NodeId peer)
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                nErased += EraseOrphanTx(maybeErase->first);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweeping again before the next entry expires would find nothing
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > MAX_ORPHAN_TRANSACTIONS_SIZE) {
+        // Evict a random orphan of the peer holding the most of them
+        map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+        for (map<NodeId, set<uint256> >::iterator it = itPeer; it != mapOrphanTransactionsByPeer.end(); ++it) {
+            if (it->second.size() > itPeer->second.size())
+                itPeer = it;
+        }
+        set<uint256>::iterator it = itPeer->second.lower_bound(GetRandHash());
+        if (it == itPeer->second.end())
+            it = itPeer->second.begin();
+        EraseOrphanTx(*it);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+/** Queue the orphans spending outputs of tx for reprocessing on pfrom's next turn */
+void static AddOrphanWork(CNode* pfrom, const CTransaction& tx)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi)
+            pfrom->setOrphanWork.insert((*mi)->first);
+    }
+}
+
+/** Retry queued orphans until one is accepted or rejected, so a long chain
+ *  of orphans is worked through one transaction per message handler turn */
+void static ProcessOrphanTx(CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+    while (!pfrom->setOrphanWork.empty()) {
+        const uint256 orphanHash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        CTransactionRef porphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2)) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(*porphanTx);
+            AddOrphanWork(pfrom, *porphanTx);
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        } else if (!fMissingInputs2) {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+    }
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -893,7 +1002,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
+        auto i = mapTxLocks.find(nTXHash);
         if (i != mapTxLocks.end()) {
             sigs = (*i).second.CountSignatures();
         }
@@ -909,7 +1018,7 @@ int GetIXConfirmations(uint256 nTXHash)
 {
     int sigs = 0;
 
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
+    auto i = mapTxLocks.find(nTXHash);
     if (i != mapTxLocks.end()) {
         sigs = (*i).second.CountSignatures();
     }
@@ -976,7 +1085,7 @@ bool MoneyRange(CAmount nValueOut)
     return nValueOut >= 0 && nValueOut <= Params().MaxMoneyOut();
 }
 
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, const int64_t nBlockTime)
+bool CheckTransactionSanity(const CTransaction& tx, CValidationState& state)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1030,6 +1139,14 @@ bool CheckTransaction(const CTransaction& tx, CValidationState& state, const int
                     REJECT_INVALID, "bad-txns-prevout-null");
     }
 
+    return true;
+}
+
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, const int64_t nBlockTime)
+{
+    if (!CheckTransactionSanity(tx, state))
+        return false;
+
     // Check tx filter
     if (!IsInitialBlockDownload()) {
          if (!CheckTxFilter(tx, nBlockTime)) {
@@ -1046,12 +1163,12 @@ bool CheckTxFilter(const CTransaction& tx, const int64_t nBlockTime)
     if (nBlockTime != 0 && nBlockTime < GetAdjustedTime() - 24 * 60 * 60)
         return true;
     // Check if they are filtered spender in the current tx
-    if (!mapFilterAddress.empty()) {
+    std::shared_ptr<const TxFilterMap> pfilter = GetTxFilter();
+    if (!pfilter->empty()) {
         CTransaction prevoutTx;
         uint256 prevoutHashBlock;
         txnouttype txType;
         vector<CTxDestination> vDest;
-        CBitcoinAddress Address;
         int nRequiredRet;
         for (const CTxIn& txin : tx.vin) {
             if (!GetTransaction(txin.prevout.hash, prevoutTx, prevoutHashBlock))
@@ -1059,12 +1176,11 @@ bool CheckTxFilter(const CTransaction& tx, const int64_t nBlockTime)
             if (!ExtractDestinations(prevoutTx.vout[txin.prevout.n].scriptPubKey, txType, vDest, nRequiredRet))
                 continue;
             for (const CTxDestination& txDest : vDest) {
-                Address.Set(txDest);
-                auto it = mapFilterAddress.find(Address);
-                if (it != mapFilterAddress.end()) {
+                auto it = pfilter->find(txDest);
+                if (it != pfilter->end()) {
                     if (nBlockTime == 0 || nBlockTime > (*it).second) {
                         LogPrintf("CheckTxFilter(): Tx %s contains the filtered "
-                                  "address %s\n", tx.GetHash().ToString(), Address.ToString());
+                                  "address %s\n", tx.GetHash().ToString(), CBitcoinAddress(txDest).ToString());
                         return false;
                     }
                 }
@@ -1133,15 +1249,88 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
 {
-    AssertLockHeld(cs_main);
-    if (pfMissingInputs)
-        *pfMissingInputs = false;
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    if (!CheckTransaction(tx, state))
-        return error("AcceptToMemoryPool: : CheckTransaction failed");
+    pool.TrimToSize(limit);
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/**
+ * Set state for a script check of tx, spending coins, that failed under flags.
+ */
+static bool ScriptCheckFailed(const CTransaction& tx, const CCoins& coins, const CScriptCheck& check, unsigned int flags, bool cacheStore, CValidationState& state)
+{
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-standard DER encodings or non-null dummy
+        // arguments; if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        CScriptCheck checkMandatory(coins, tx, check.GetInputIndex(),
+            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+        if (checkMandatory())
+            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(checkMandatory.GetScriptError())));
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+}
+
+/**
+ * Script checks for memory pool acceptance. Transactions with more than one
+ * input have their scripts checked on the script-checking threads; if any
+ * input fails, state reports the lowest failing input the way a serial check
+ * would.
+ */
+static bool CheckMempoolInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags)
+{
+    if (!nScriptCheckThreads || tx.vin.size() < 2)
+        return CheckInputs(tx, state, view, true, flags, true);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, &vChecks))
+        return false;
+    CScriptCheck checkFailed;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait(&checkFailed))
+        return true;
 
+    // The queue stops at the first failure it runs into, which need not be the
+    // lowest input and may have left lower inputs unchecked. Check those in
+    // order (the ones that passed are signature cache hits), so the reject
+    // reason and DoS score don't depend on thread timing.
+    for (unsigned int i = 0; i < checkFailed.GetInputIndex(); i++) {
+        const CCoins* coins = view.AccessCoins(tx.vin[i].prevout.hash);
+        assert(coins);
+        CScriptCheck check(*coins, tx, i, flags, true);
+        if (!check())
+            return ScriptCheckFailed(tx, *coins, check, flags, true, state);
+    }
+    const CCoins* coins = view.AccessCoins(tx.vin[checkFailed.GetInputIndex()].prevout.hash);
+    assert(coins);
+    return ScriptCheckFailed(tx, *coins, checkFailed, flags, true, state);
+}
+
+/**
+ * Policy checks AcceptToMemoryPool makes on tx before looking up its inputs:
+ * no loose coinbase or coinstake, standardness, and no conflict with the pool
+ * or a SwiftX lock. Returns false without a reject reason for a transaction
+ * the pool already has or one spending an output the pool already spends.
+ */
+static bool CheckMempoolTxPolicy(CTxMemPool& pool, CValidationState& state, const CTransaction& tx)
+{
     // Coinbase is only valid in a block, not as a loose transaction
     if (tx.IsCoinBase())
         return state.DoS(100, error("AcceptToMemoryPool: : coinbase as individual tx"),
@@ -1161,20 +1350,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     // is it already in the memory pool?
     uint256 hash = tx.GetHash();
     if (pool.exists(hash)) {
-        LogPrintf("%s tx already in mempool\n", __func__);
+        LogPrintf("AcceptToMemoryPool : tx already in mempool\n");
         return false;
     }
 
     // ----------- swiftTX transaction scanning -----------
 
-    for (const CTxIn& in : tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        return state.DoS(0,
+            error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -1189,12 +1375,91 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
     }
 
+    return true;
+}
+
+/**
+ * Policy checks AcceptToMemoryPool makes once the inputs of tx are in view,
+ * short of the ancestor limits and script checks: input standardness,
+ * sigops, fees, priority and the insane fee guard. Sets nSigOps and nFees.
+ * The free transaction rate limiter stays with the caller, since it counts
+ * what it lets through.
+ */
+static bool CheckMempoolInputsPolicy(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, const CCoinsViewCache& view, bool fLimitFree, bool fRejectInsaneFee, bool ignoreFees, unsigned int& nSigOps, CAmount& nFees)
+{
+    uint256 hash = tx.GetHash();
+
+    // Check for non-standard pay-to-script-hash in inputs
+    if (Params().RequireStandard() && !AreInputsStandard(tx, view))
+        return error("AcceptToMemoryPool: : nonstandard transaction input");
+
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    nSigOps = GetLegacySigOpCount(tx);
+    nSigOps += GetP2SHSigOpCount(tx, view);
+    if (nSigOps > MAX_TX_SIGOPS)
+        return state.DoS(0,
+            error("AcceptToMemoryPool : too many sigops %s, %d > %d",
+                hash.ToString(), nSigOps, MAX_TX_SIGOPS),
+            REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+
+    nFees = view.GetValueIn(tx) - tx.GetValueOut();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Don't accept it if it can't get into a block
+    // but don't check fees for dstx, which is prioritised instead
+    if (!mapObfuscationBroadcastTxes.count(hash) && !ignoreFees) {
+        CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
+        if (fLimitFree && nFees < txMinFee)
+            return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
+                                    hash.ToString(), nFees, txMinFee),
+                REJECT_INSUFFICIENTFEE, "insufficient fee");
+
+        // A full pool raises the fee needed to get in above what it last evicted
+        double dPriorityDelta = 0;
+        CAmount nModifiedFees = nFees;
+        pool.ApplyDeltas(hash, dPriorityDelta, nModifiedFees);
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), nModifiedFees, mempoolRejectFee),
+                REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
+        // Require that free transactions have sufficient priority to be mined in the next block.
+        if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
+        }
+    }
+
+    if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
+        return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
+            hash.ToString(),
+            nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
+
+    return true;
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
+{
+    const CTransaction& tx = *ptx;
+    AssertLockHeld(cs_main);
+    if (pfMissingInputs)
+        *pfMissingInputs = false;
+
+    if (!CheckTransaction(tx, state))
+        return error("AcceptToMemoryPool: : CheckTransaction failed");
+
+    if (!CheckMempoolTxPolicy(pool, state, tx))
+        return false;
+    uint256 hash = tx.GetHash();
 
     {
         CCoinsView dummy;
         CCoinsViewCache view(&dummy);
 
-        CAmount nValueIn = 0;
         {
             LOCK(pool.cs);
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
@@ -1223,84 +1488,63 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             // Bring the best block into scope
             view.GetBestBlock();
 
-            nValueIn = view.GetValueIn(tx);
-
             // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
             view.SetBackend(dummy);
         }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (Params().RequireStandard() && !AreInputsStandard(tx, view))
-            return error("AcceptToMemoryPool: : nonstandard transaction input");
-
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, view);
-        if (nSigOps > MAX_TX_SIGOPS)
-            return state.DoS(0,
-                error("AcceptToMemoryPool : too many sigops %s, %d > %d",
-                    hash.ToString(), nSigOps, MAX_TX_SIGOPS),
-                REJECT_NONSTANDARD, "bad-txns-too-many-sigops");
+        unsigned int nSigOps = 0;
+        CAmount nFees = 0;
+        if (!CheckMempoolInputsPolicy(pool, state, tx, view, fLimitFree, fRejectInsaneFee, ignoreFees, nSigOps, nFees))
+            return false;
 
-        CAmount nValueOut = tx.GetValueOut();
-        CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
-        // Don't accept it if it can't get into a block
-        // but prioritise dstx and don't check fees for it
+        // Prioritise dstx, whose fees go unchecked
         if (mapObfuscationBroadcastTxes.count(hash)) {
             mempool.PrioritiseTransaction(hash, hash.ToString(), 1000, 0.1 * COIN);
-        } else if (!ignoreFees) {
-            CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
-            if (fLimitFree && nFees < txMinFee)
-                return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d",
-                                        hash.ToString(), nFees, txMinFee),
-                    REJECT_INSUFFICIENTFEE, "insufficient fee");
-
-            // Require that free transactions have sufficient priority to be mined in the next block.
-            if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
-                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
-            }
-
+        } else if (!ignoreFees && fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize)) {
             // Continuously rate-limit free (really, very-low-fee) transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
-            if (fLimitFree && nFees < ::minRelayTxFee.GetFee(nSize)) {
-                static CCriticalSection csFreeLimiter;
-                static double dFreeCount;
-                static int64_t nLastTime;
-                int64_t nNow = GetTime();
-
-                LOCK(csFreeLimiter);
-
-                // Use an exponentially decaying ~10-minute window:
-                dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
-                nLastTime = nNow;
-                // -limitfreerelay unit is thousand-bytes-per-minute
-                // At default rate it would take over a month to fill 1GB
-                if (dFreeCount >= GetArg("-limitfreerelay", 30) * 10 * 1000)
-                    return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
-                        REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
-                dFreeCount += nSize;
-            }
+            static CCriticalSection csFreeLimiter;
+            static double dFreeCount;
+            static int64_t nLastTime;
+            int64_t nNow = GetTime();
+
+            LOCK(csFreeLimiter);
+
+            // Use an exponentially decaying ~10-minute window:
+            dFreeCount *= pow(1.0 - 1.0 / 600.0, (double)(nNow - nLastTime));
+            nLastTime = nNow;
+            // -limitfreerelay unit is thousand-bytes-per-minute
+            // At default rate it would take over a month to fill 1GB
+            if (dFreeCount >= GetArg("-limitfreerelay", 30) * 10 * 1000)
+                return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
+                    REJECT_INSUFFICIENTFEE, "rate limited free transaction");
+            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
+            dFreeCount += nSize;
+        }
+
+        // Keep in-mempool chains short enough that package tracking and block assembly stay cheap
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        {
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : %s %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
         }
 
-        if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
-            return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
-                hash.ToString(),
-                nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
-
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckMempoolInputs(tx, state, view, STANDARD_SCRIPT_VERIFY_FLAGS)) {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
@@ -1313,12 +1557,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckMempoolInputs(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS)) {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // Trim the pool and make sure the transaction survived it
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1326,6 +1575,147 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, ptx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPool(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return error("%s : unsupported mempool file version %d", __func__, version);
+        }
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransaction txIn;
+            int64_t nTime;
+            double dPriorityDelta;
+            int64_t nFeeDelta;
+            file >> txIn;
+            CTransactionRef tx = MakeTransactionRef(std::move(txIn));
+            file >> nTime;
+            file >> dPriorityDelta;
+            file >> nFeeDelta;
+
+            if (dPriorityDelta != 0 || nFeeDelta != 0) {
+                mempool.PrioritiseTransaction(tx->GetHash(), tx->GetHash().ToString(), dPriorityDelta, nFeeDelta);
+            }
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime)) {
+                    ++count;
+                } else {
+                    ++failed;
+                }
+            } else {
+                ++skipped;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+        // Deltas for transactions that were not in the pool when it was dumped
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (const auto& i : mapDeltas) {
+            mempool.PrioritiseTransaction(i.first, i.first.ToString(), i.second.first, i.second.second);
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    int64_t nElapsed = GetTimeMillis() - nStart;
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired  %dms (%.1f tx/s)\n",
+        count, failed, skipped, nElapsed, nElapsed > 0 ? 1000.0 * (count + failed) / nElapsed : 0.0);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t start = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransactionRef, int64_t> > vtx;
+
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vtx.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& e : mempool.mapTx)
+            vtx.push_back(std::make_pair(e.GetSharedTx(), e.GetTime()));
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr) {
+            return false;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+
+        file << (uint64_t)vtx.size();
+        for (const auto& i : vtx) {
+            const uint256 hash = i.first->GetHash();
+            double dPriorityDelta = 0;
+            int64_t nFeeDelta = 0;
+            std::map<uint256, std::pair<double, CAmount> >::iterator it = mapDeltas.find(hash);
+            if (it != mapDeltas.end()) {
+                dPriorityDelta = it->second.first;
+                nFeeDelta = it->second.second;
+                mapDeltas.erase(it);
+            }
+            file << *i.first;
+            file << i.second;
+            file << dPriorityDelta;
+            file << nFeeDelta;
+        }
+
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, GetDataDir() / "mempool.dat");
+        int64_t last = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid - start) * 0.000001, (last - mid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1355,14 +1745,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- swiftTX transaction scanning -----------
 
-    for (const CTxIn& in : tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        return state.DoS(0,
+            error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -1439,7 +1826,7 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1961,26 +2348,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
                 } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
-                        if (check())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+                    return ScriptCheckFailed(tx, *coins, check, flags, cacheStore, state);
                 }
             }
         }
@@ -2070,7 +2438,6 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     }
 
     if (txFilterState && txFilterTarget > pindex->nHeight) {
-        //setFilterAddress.clear();
         InitTxFilter();
         txFilterState = false;
     }
@@ -2111,14 +2478,109 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("vkcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, bool fRejectInsaneFee)
+{
+    vState.assign(vtx.size(), CValidationState());
+    vAccepted.assign(vtx.size(), false);
+
+    // Context-free checks need no lock. The tx filter, which needs chain
+    // state, is left to AcceptToMemoryPool.
+    std::vector<bool> vCheckedTx(vtx.size(), false);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        vCheckedTx[i] = CheckTransactionSanity(*vtx[i], vState[i]);
+
+    // Order the batch so parents are submitted before their children
+    std::map<uint256, unsigned int> mapBatch;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        mapBatch.insert(std::make_pair(vtx[i]->GetHash(), i));
+    std::vector<unsigned int> vParents(vtx.size(), 0);
+    std::vector<std::vector<unsigned int> > vChildren(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        std::set<unsigned int> setParents;
+        for (const CTxIn& txin : vtx[i]->vin) {
+            std::map<uint256, unsigned int>::const_iterator it = mapBatch.find(txin.prevout.hash);
+            if (it != mapBatch.end() && it->second != i)
+                setParents.insert(it->second);
+        }
+        vParents[i] = setParents.size();
+        for (unsigned int parent : setParents)
+            vChildren[parent].push_back(i);
+    }
+    std::vector<unsigned int> vOrder;
+    vOrder.reserve(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        if (vParents[i] == 0)
+            vOrder.push_back(i);
+    }
+    for (unsigned int n = 0; n < vOrder.size(); n++) {
+        for (unsigned int child : vChildren[vOrder[n]]) {
+            if (--vParents[child] == 0)
+                vOrder.push_back(child);
+        }
+    }
+
+    LOCK(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Verify the scripts of the batch at once on the script check queue,
+    // for the transactions that get past the cheaper policy checks first.
+    // Valid signatures land in the signature cache, so the checks
+    // AcceptToMemoryPool repeats below are cache hits; failures are
+    // reported by AcceptToMemoryPool itself.
+    unsigned int nChecks = 0;
+    if (nScriptCheckThreads) {
+        std::vector<CScriptCheck> vChecks;
+        {
+            CCoinsView dummy;
+            CCoinsViewCache view(&dummy);
+            LOCK(pool.cs);
+            CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+            view.SetBackend(viewMemPool);
+            for (unsigned int i : vOrder) {
+                const CTransaction& tx = *vtx[i];
+                // The same policy checks AcceptToMemoryPool makes before its script checks
+                CValidationState stateDummy;
+                unsigned int nSigOps;
+                CAmount nFees;
+                if (!vCheckedTx[i] || !CheckMempoolTxPolicy(pool, stateDummy, tx) ||
+                    view.HaveCoins(tx.GetHash()) || !view.HaveInputs(tx) ||
+                    !CheckMempoolInputsPolicy(pool, stateDummy, tx, view, false, fRejectInsaneFee, false, nSigOps, nFees))
+                    continue;
+                std::vector<CScriptCheck> vTxChecks;
+                if (!CheckInputs(tx, stateDummy, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vTxChecks))
+                    continue;
+                for (CScriptCheck& check : vTxChecks) {
+                    vChecks.push_back(CScriptCheck());
+                    check.swap(vChecks.back());
+                }
+                // Later transactions in the batch may spend this one
+                view.ModifyCoins(tx.GetHash())->FromTx(tx, MEMPOOL_HEIGHT);
+            }
+            view.SetBackend(dummy);
+        }
+        nChecks = vChecks.size();
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+    int64_t nTimeChecks = GetTimeMicros();
+
+    for (unsigned int i : vOrder) {
+        if (!vCheckedTx[i])
+            continue;
+        vAccepted[i] = AcceptToMemoryPool(pool, vState[i], vtx[i], false, NULL, fRejectInsaneFee);
+    }
+    int64_t nTimeCommit = GetTimeMicros();
+    LogPrint("bench", "    - Batch of %u txs: %.2fms script checks (%u inputs), %.2fms mempool commit\n",
+        vtx.size(), 0.001 * (nTimeChecks - nTimeStart), nChecks, 0.001 * (nTimeCommit - nTimeChecks));
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -2418,6 +2880,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
 
     cvBlockChange.notify_all();
 
+    // Only the wallet's cached balances follow the tip; other listeners learn of blocks elsewhere
+    if (pwalletMain)
+        pwalletMain->UpdatedBlockTip(pindexNew);
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     static bool fWarned = false;
     if (!IsInitialBlockDownload() && !fWarned) {
@@ -2544,7 +3010,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
 
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
+    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
@@ -3198,15 +3664,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         for (const CTransaction& tx : block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
-                for (const CTxIn& in : tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 hashLockTx;
+                if (FindConflictingLock(tx, hashLockTx)) {
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLockTx.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                        REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -3659,15 +4122,9 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         }
     }
 
-    if (pwalletMain) {
-        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
-        if (pwalletMain->isMultiSendEnabled())
-            pwalletMain->MultiSend();
-
-        // If turned on Auto Combine will scan wallet for dust to combine
-        if (pwalletMain->fCombineDust)
-            pwalletMain->AutoCombineDust();
-    }
+    // MultiSend and auto-combine build their transactions on the wallet's autosend thread
+    if (pwalletMain && (pwalletMain->isMultiSendEnabled() || pwalletMain->fCombineDust))
+        pwalletMain->RequestAutoSend();
 
     LogPrintf("%s : ACCEPTED in %ld milliseconds with size=%d\n", __func__, GetTimeMillis() - nStartTime,
         pblock->GetSerializeSize(SER_DISK, CLIENT_VERSION));
@@ -4522,23 +4979,22 @@ void static ProcessGetData(CNode* pfrom)
                 }
             }
         } else if (inv.IsKnownType()) {
-            // Send stream from relay memory
+            // Send stream from relay memory, which only holds transactions
             bool pushed = false;
-            {
-                LOCK(cs_mapRelay);
-                map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                if (mi != mapRelay.end()) {
-                    pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+            if (inv.type == MSG_TX) {
+                CRelayCache::CPayloadRef payload = relayCache.Find(inv);
+                if (payload) {
+                    pfrom->PushMessage(inv.GetCommand(), *payload);
                     pushed = true;
                 }
             }
 
             if (!pushed && inv.type == MSG_TX) {
-                CTransaction tx;
-                if (mempool.lookup(inv.hash, tx)) {
+                CTransactionRef ptx = mempool.get(inv.hash);
+                if (ptx) {
                     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                     ss.reserve(1000);
-                    ss << tx;
+                    ss << *ptx;
                     pfrom->PushMessage("tx", ss);
                     pushed = true;
                 }
@@ -4977,8 +5433,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 
     else if (strCommand == "tx" || strCommand == "dstx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -5027,7 +5481,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        CInv inv(MSG_TX, tx.GetHash());
+        // From here on the transaction is shared with the mempool, relay and orphan pool
+        CTransactionRef ptx = MakeTransactionRef(std::move(tx));
+        CInv inv(MSG_TX, ptx->GetHash());
         pfrom->AddInventoryKnown(inv);
 
         LOCK(cs_main);
@@ -5038,68 +5494,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         mapAlreadyAskedFor.erase(inv);
 
         if (!txFilterState) {
-            LogPrintf("Transaction not accepted because txFilter not initialized. tx=%s\n", tx.GetHash().ToString());
+            LogPrintf("Transaction not accepted because txFilter not initialized. tx=%s\n", ptx->GetHash().ToString());
             return true;
         }
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
+        if (AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, false, ignoreFees)) {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+            RelayTransaction(*ptx);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
+                ptx->GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+            // Orphans that depended on this one are retried on this peer's next turns
+            AddOrphanWork(pfrom, *ptx);
         } else if (fMissingInputs) {
-            if (CheckTxFilter(tx, 0)) {
-                AddOrphanTx(tx, pfrom->GetId());
+            if (CheckTxFilter(*ptx, 0)) {
+                AddOrphanTx(ptx, pfrom->GetId());
                 // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
                 unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
@@ -5111,17 +5523,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // if they are already in the mempool (allowing the node to function
             // as a gateway for nodes hidden behind it).
 
-            RelayTransaction(tx);
+            RelayTransaction(*ptx);
         }
 
         if (strCommand == "dstx") {
-            CInv inv(MSG_DSTX, tx.GetHash());
+            CInv inv(MSG_DSTX, ptx->GetHash());
             RelayInv(inv);
         }
 
         int nDoS = 0;
         if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", ptx->GetHash().ToString(),
                 pfrom->id, pfrom->cleanSubVer,
                 state.GetRejectReason());
             pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
@@ -5254,10 +5666,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CInv> vInv;
         for (uint256& hash : vtxid) {
             CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
+            CTransactionRef ptx = mempool.get(hash);
+            if (!ptx) continue; // another thread removed since queryHashes, maybe...
+            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(*ptx)) ||
                 (!pfrom->pfilter))
                 vInv.push_back(inv);
             if (vInv.size() == MAX_INV_SZ) {
@@ -5491,8 +5902,15 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
+    if (!pfrom->setOrphanWork.empty()) {
+        LOCK(cs_main);
+        ProcessOrphanTx(pfrom);
+    }
+
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
+    // finish the orphans before reading further messages from this peer
+    if (!pfrom->setOrphanWork.empty()) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -5866,5 +6284,6 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
     }
 } instance_of_cmaincleanup;
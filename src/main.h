@@ -69,8 +69,32 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE / 50;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, save the mempool on shutdown and reload it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Maximum number of orphan transactions kept from a single peer */
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_PER_PEER = 25;
+/** Largest orphan transaction kept, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Maximum total size of the orphan transactions kept in memory, in bytes */
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_SIZE = 1000000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -249,6 +273,28 @@ void FlushStateToDisk();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/**
+ * Submit a batch of transactions to the memory pool. Context-free checks run
+ * before taking cs_main; script checks for the transactions that pass the
+ * cheaper policy checks then run in parallel on the script check queue, and
+ * the transactions are added parents first under a single cs_main
+ * acquisition. vState and vAccepted are filled in batch order.
+ */
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, bool fRejectInsaneFee = false);
+
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/** Expire transactions older than age seconds, then evict the lowest fee rate packages until the pool fits in limit bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
+
+/** Dump the mempool, with entry times and prioritisation deltas, to mempool.dat */
+bool DumpMempool();
+
+/** Load the mempool from mempool.dat, resubmitting each transaction through AcceptToMemoryPool */
+bool LoadMempool();
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
@@ -342,7 +388,9 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
-/** Context-independent validity checks */
+/** Context-independent validity checks; safe without cs_main */
+bool CheckTransactionSanity(const CTransaction& tx, CValidationState& state);
+/** CheckTransactionSanity plus the tx filter, which looks up the spent outputs once out of initial block download */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, const int64_t nBlockTime = 0);
 bool CheckTxFilter(const CTransaction& tx, const int64_t nBlockTime);
 /**
@@ -412,6 +460,7 @@ public:
     }
 
     ScriptError GetScriptError() const { return error; }
+    unsigned int GetInputIndex() const { return nIn; }
 };
 
 
@@ -334,6 +334,8 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
 
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, unsigned mnlevel, CScript& payee)
 {
+    LOCK(cs_mapMasternodeBlocks);
+
     auto block = mapMasternodeBlocks.find(nBlockHeight);
 
     if(block == mapMasternodeBlocks.cend())
@@ -420,11 +422,14 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
     {
         LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
 
-        auto vote_ins_res = mapMasternodePayeeVotes.emplace(winnerIn.GetHash(), winnerIn);
+        uint256 hash = winnerIn.GetHash();
+        auto vote_ins_res = mapMasternodePayeeVotes.emplace(hash, winnerIn);
 
         if(!vote_ins_res.second)
             return false;
 
+        mapPayeeVotesByHeight[winnerIn.nBlockHeight].push_back(hash);
+
         auto mnblock = mapMasternodeBlocks.emplace(winnerIn.nBlockHeight, winnerIn.nBlockHeight).first;
 
         mnblock->second.AddPayee(winnerIn.payeeLevel, winnerIn.payee, 1);
@@ -585,11 +590,12 @@ bool CMasternodePayments::IsTransactionValid(const CTransaction& txNew, int nBlo
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].IsTransactionValid(txNew);
-    }
+    auto mn_block = mapMasternodeBlocks.find(nBlockHeight);
 
-    return true;
+    if(mn_block == mapMasternodeBlocks.end())
+        return true;
+
+    return mn_block->second.IsTransactionValid(txNew);
 }
 
 void CMasternodePayments::CleanPaymentList()
@@ -606,19 +612,17 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);  /*/ 100 * 125*/
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = it->second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase(it->first);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-            it = mapMasternodePayeeVotes.erase(it);
-        } else {
-            ++it;
+    // every height below nHeight - nLimit is dropped as a whole bucket
+    auto itFirstKept = mapPayeeVotesByHeight.lower_bound(nHeight - nLimit);
+    for (auto it = mapPayeeVotesByHeight.begin(); it != itFirstKept; ++it) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payments - block %d votes %d\n", it->first, it->second.size());
+        for (const uint256& hash : it->second) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        mapMasternodeBlocks.erase(it->first);
     }
+    mapPayeeVotesByHeight.erase(mapPayeeVotesByHeight.begin(), itFirstKept);
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
@@ -846,13 +850,12 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
         //LogPrintf("=== total winners = %d\n", nInvCount);
         node->PushMessage("mnwp", ss);
     } else {
-        for(const auto& vote : mapMasternodePayeeVotes) {
-            const auto& winner = vote.second;
-            bool push =  winner.nBlockHeight >= nHeight - max_mn_count && winner.nBlockHeight <= nHeight + 20;
-            if(!push)
-                continue;
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
-            ++nInvCount;
+        auto itEnd = mapPayeeVotesByHeight.upper_bound(nHeight + 20);
+        for(auto it = mapPayeeVotesByHeight.lower_bound(nHeight - (int)max_mn_count); it != itEnd; ++it) {
+            for(const uint256& hash : it->second) {
+                node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
+                ++nInvCount;
+            }
         }
         node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
     }
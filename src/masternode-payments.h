@@ -218,6 +218,8 @@ private:
 
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    // vote hashes bucketed by block height, pruning drops whole heights at once
+    std::map<int, std::vector<uint256> > mapPayeeVotesByHeight;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote;
 
@@ -231,6 +233,7 @@ public:
         LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotesByHeight.clear();
         mapMasternodesLastVote.clear();
     }
 
@@ -258,6 +261,12 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+
+        if (ser_action.ForRead()) {
+            mapPayeeVotesByHeight.clear();
+            for (const auto& vote : mapMasternodePayeeVotes)
+                mapPayeeVotesByHeight[vote.second.nBlockHeight].push_back(vote.first);
+        }
     }
 };
 
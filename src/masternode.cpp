@@ -286,11 +286,12 @@ int64_t CMasternode::GetLastPaid()
         }
         n++;
 
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
+        auto mn_block = masternodePayments.mapMasternodeBlocks.find(BlockReading->nHeight);
+        if (mn_block != masternodePayments.mapMasternodeBlocks.end()) {
             /*
                 Search for this payee, with at least 6 votes.
             */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 6)) {
+            if (mn_block->second.HasPayeeWithVotes(mnpayee, 6)) {
                 return BlockReading->nTime - nOffset;
             }
         }
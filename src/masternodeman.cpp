@@ -46,6 +46,57 @@ struct CompareScoreMN {
 // CMasternodeDB
 //
 
+/** Writes through to a file while hashing everything written */
+class CHashingFileWriter
+{
+private:
+    CAutoFile& fileout;
+    CHashWriter hasher;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashingFileWriter(CAutoFile& fileoutIn) : fileout(fileoutIn), hasher(fileoutIn.GetType(), fileoutIn.GetVersion())
+    {
+        nType = fileoutIn.GetType();
+        nVersion = fileoutIn.GetVersion();
+    }
+
+    CHashingFileWriter& write(const char* pch, size_t size)
+    {
+        fileout.write(pch, size);
+        hasher.write(pch, size);
+        return (*this);
+    }
+
+    template <typename T>
+    CHashingFileWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    // invalidates the object
+    uint256 GetHash() { return hasher.GetHash(); }
+};
+
+static void WriteSection(CHashingFileWriter& fileout, uint32_t nSection, const CDataStream& ssSection)
+{
+    uint64_t nSize = ssSection.size();
+    fileout << nSection << nSize << ssSection;
+}
+
+template <typename T>
+static void WriteSection(CHashingFileWriter& fileout, uint32_t nSection, const T& obj)
+{
+    int64_t nStart = GetTimeMillis();
+    CDataStream ssSection(fileout.nType, fileout.nVersion);
+    ssSection << obj;
+    WriteSection(fileout, nSection, ssSection);
+    LogPrint("masternode", "CMasternodeDB - section %d: %d bytes %dms\n", nSection, ssSection.size(), GetTimeMillis() - nStart);
+}
+
 CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
@@ -56,23 +107,35 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
     // open output file, and associate with CAutoFile
     FILE* file = fopen(pathMN.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s : Failed to open file %s", __func__, pathMN.string());
 
-    // Write and commit header, data
+    // stream header and sections to disk, checksumming as we go, then append checksum
     try {
-        fileout << ssMasternodes;
+        CHashingFileWriter hashedout(fileout);
+        hashedout << strMagicMessage;                   // masternode cache file specific magic message
+        hashedout << FLATDATA(Params().MessageStart()); // network specific magic number
+        hashedout << CURRENT_VERSION;
+        {
+            LOCK(mnodemanToSave.cs);
+            WriteSection(hashedout, SECTION_MASTERNODES, mnodemanToSave.vMasternodes);
+
+            CDataStream ssRequests(SER_DISK, CLIENT_VERSION);
+            ssRequests << mnodemanToSave.mAskedUsForMasternodeList;
+            ssRequests << mnodemanToSave.mWeAskedForMasternodeList;
+            ssRequests << mnodemanToSave.mWeAskedForMasternodeListEntry;
+            ssRequests << mnodemanToSave.mAskedUsForWinnerMasternodeList;
+            ssRequests << mnodemanToSave.mWeAskedForWinnerMasternodeList;
+            ssRequests << mnodemanToSave.nDsqCount;
+            WriteSection(hashedout, SECTION_REQUESTS, ssRequests);
+
+            WriteSection(hashedout, SECTION_SEEN_BROADCASTS, mnodemanToSave.mapSeenMasternodeBroadcast);
+            WriteSection(hashedout, SECTION_SEEN_PINGS, mnodemanToSave.mapSeenMasternodePing);
+        }
+        fileout << hashedout.GetHash();
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
@@ -127,6 +190,7 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
 
     unsigned char pchMsgTmp[4];
     std::string strMagicMessageTmp;
+    uint32_t nVersionTmp;
     try {
         // de-serialize file header (masternode cache file specific magic message) and ..
 
@@ -146,8 +210,49 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
             error("%s : Invalid network magic number", __func__);
             return IncorrectMagicNumber;
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
+
+        // older caches carry no format version and are recreated
+        ssMasternodes >> nVersionTmp;
+        if (nVersionTmp != CURRENT_VERSION)
+            throw std::runtime_error(strprintf("unsupported format version %u", nVersionTmp));
+
+        // de-serialize sections directly into CMasternodeMan object
+        LOCK(mnodemanToLoad.cs);
+        while (!ssMasternodes.empty()) {
+            uint32_t nSection;
+            uint64_t nSize;
+            ssMasternodes >> nSection >> nSize;
+            if (nSize > ssMasternodes.size())
+                throw std::runtime_error(strprintf("section %u exceeds file size", nSection));
+            unsigned int nRemaining = ssMasternodes.size() - nSize;
+
+            switch (nSection) {
+            case SECTION_MASTERNODES:
+                ssMasternodes >> mnodemanToLoad.vMasternodes;
+                break;
+            case SECTION_REQUESTS:
+                ssMasternodes >> mnodemanToLoad.mAskedUsForMasternodeList;
+                ssMasternodes >> mnodemanToLoad.mWeAskedForMasternodeList;
+                ssMasternodes >> mnodemanToLoad.mWeAskedForMasternodeListEntry;
+                ssMasternodes >> mnodemanToLoad.mAskedUsForWinnerMasternodeList;
+                ssMasternodes >> mnodemanToLoad.mWeAskedForWinnerMasternodeList;
+                ssMasternodes >> mnodemanToLoad.nDsqCount;
+                break;
+            case SECTION_SEEN_BROADCASTS:
+                ssMasternodes >> mnodemanToLoad.mapSeenMasternodeBroadcast;
+                break;
+            case SECTION_SEEN_PINGS:
+                ssMasternodes >> mnodemanToLoad.mapSeenMasternodePing;
+                break;
+            default:
+                // written by a newer version, skip it
+                ssMasternodes.ignore(nSize);
+                break;
+            }
+
+            if (ssMasternodes.size() != nRemaining)
+                throw std::runtime_error(strprintf("section %u size mismatch", nSection));
+        }
     } catch (std::exception& e) {
         mnodemanToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -166,15 +271,70 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
     return Ok;
 }
 
+CMasternodeDB::ReadResult CMasternodeDB::Verify()
+{
+    // open input file, and associate with CAutoFile
+    FILE* file = fopen(pathMN.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return FileError;
+
+    int fileSize = boost::filesystem::file_size(pathMN);
+    int dataSize = fileSize - sizeof(uint256);
+    if (dataSize < 0)
+        return HashReadError;
+
+    // hash the data in fixed size chunks instead of loading it
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    std::string strMagicMessageTmp;
+    unsigned char pchMsgTmp[4];
+    uint32_t nVersionTmp = 0;
+    uint256 hashIn;
+    try {
+        std::vector<char> vchChunk(65536);
+        for (int nPos = 0; nPos < dataSize;) {
+            int nChunk = std::min<int>(vchChunk.size(), dataSize - nPos);
+            filein.read(&vchChunk[0], nChunk);
+            if (nPos == 0) {
+                // the header always fits in the first chunk
+                CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+                ssHeader.write(&vchChunk[0], nChunk);
+                try {
+                    ssHeader >> strMagicMessageTmp >> FLATDATA(pchMsgTmp) >> nVersionTmp;
+                } catch (std::exception&) {
+                    // leave the header fields unset, reported below as a bad magic message
+                }
+            }
+            hasher.write(&vchChunk[0], nChunk);
+            nPos += nChunk;
+        }
+        filein >> hashIn;
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return HashReadError;
+    }
+    filein.fclose();
+
+    if (hashIn != hasher.GetHash())
+        return IncorrectHash;
+    if (strMagicMessage != strMagicMessageTmp)
+        return IncorrectMagicMessage;
+    if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+        return IncorrectMagicNumber;
+    if (nVersionTmp != CURRENT_VERSION)
+        return IncorrectFormat;
+
+    return Ok;
+}
+
 void DumpMasternodes()
 {
     int64_t nStart = GetTimeMillis();
 
     CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
 
     LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
+    CMasternodeDB::ReadResult readResult = mndb.Verify();
     // there was an error and it was not an error on file opening => do not proceed
     if (readResult == CMasternodeDB::FileError)
         LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
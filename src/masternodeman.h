@@ -25,6 +25,11 @@ extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
+ *
+ * File layout: magic message, network magic, format version, then a sequence
+ * of sections (id, payload size, payload) and a trailing checksum over
+ * everything before it. Sections are streamed straight to disk on write and
+ * deserialized in a single pass on read; unknown sections are skipped.
  */
 class CMasternodeDB
 {
@@ -43,13 +48,26 @@ public:
         IncorrectFormat
     };
 
+    enum Section {
+        SECTION_MASTERNODES = 1,
+        SECTION_REQUESTS = 2,
+        SECTION_SEEN_BROADCASTS = 3,
+        SECTION_SEEN_PINGS = 4
+    };
+
+    static const uint32_t CURRENT_VERSION = 2;
+
     CMasternodeDB();
     bool Write(const CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    /// Check header and checksum without deserializing any masternode data
+    ReadResult Verify();
 };
 
 class CMasternodeMan
 {
+    friend class CMasternodeDB;
+
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
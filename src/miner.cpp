@@ -26,7 +26,6 @@
 #include "masternode-payments.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -35,53 +34,372 @@ using namespace std;
 // vkcoinMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+// Priority space candidates, ordered by priority
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second); // Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+// Keeps the weakest of the best candidates found so far on top of the heap
+struct TxCoinAgePriorityReverseCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
+    {
+        return TxCoinAgePriorityCompare()(b, a);
+    }
+};
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
+// Smallest transaction that can take up priority space, which bounds how many
+// candidates the priority space needs
+static const unsigned int MIN_PRIORITY_TX_SIZE = 60;
+
+// Packages are added ancestors first
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    void operator()(CTxMemPoolModifiedEntry& e)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+BlockAssembler::BlockAssembler(CTxMemPool& poolIn, CBlockTemplate* pblocktemplateIn, int nHeightIn) : pool(poolIn), pblocktemplate(pblocktemplateIn), nHeight(nHeightIn), view(pcoinsTip)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    // Room for the coinbase and coinstake
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    nBlockTx = 0;
+    nFees = 0;
+
+    fPrintPriority = GetBoolArg("-printpriority", false);
+}
+
+void BlockAssembler::AddMempoolTransactions()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
+    addPriorityTxs();
+    addPackageTxs();
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter, double dPriority)
+{
+    pblocktemplate->block.vtx.push_back(iter->GetTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    CValidationState state;
+    CTxUndo txundo;
+    UpdateCoins(iter->GetTx(), state, view, txundo, nHeight);
+
+    if (fPrintPriority) {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+    }
+}
+
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
+{
+    for (CTxMemPool::txiter parent : pool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + iter->GetSigOpCount() >= MAX_BLOCK_SIGOPS)
+        return false;
+    const CTransaction& tx = iter->GetTx();
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+        return false;
+    return TestPackageInputs(std::vector<CTxMemPool::txiter>(1, iter));
+}
+
+bool BlockAssembler::TestPackageInputs(const std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    // Spend the package parents first in a throwaway layer, so one with missing,
+    // spent, immature or invalidly signed inputs is skipped rather than making the
+    // whole block invalid
+    CCoinsViewCache viewPackage(&view);
+    for (CTxMemPool::txiter it : sortedEntries) {
+        const CTransaction& tx = it->GetTx();
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+    }
+    return true;
+}
+
+void BlockAssembler::addPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Priority moves with the chain height, so unlike fee rate it has no standing index;
+    // each entry's is computed from the values cached when it entered the pool. Only as
+    // many of the best candidates as could fill the priority space are kept, so the heap
+    // stays small however large the pool grows.
+    vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    TxCoinAgePriorityReverseCompare reversecomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+
+    const size_t nMaxCandidates = nBlockPrioritySize / MIN_PRIORITY_TX_SIZE + 1;
+    vecPriority.reserve(std::min(pool.mapTx.size(), nMaxCandidates));
+    for (CTxMemPool::indexed_transaction_set::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        pool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        TxCoinAgePriority candidate(dPriority, mi);
+        if (vecPriority.size() < nMaxCandidates) {
+            vecPriority.push_back(candidate);
+            std::push_heap(vecPriority.begin(), vecPriority.end(), reversecomparer);
+        } else if (pricomparer(vecPriority.front(), candidate)) {
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), reversecomparer);
+            vecPriority.back() = candidate;
+            std::push_heap(vecPriority.begin(), vecPriority.end(), reversecomparer);
+        }
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while (!vecPriority.empty()) {
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        double actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // Wait for its in-mempool parents to be included first
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        if (TestForBlock(iter)) {
+            AddToBlock(iter, actualPriority);
+
+            // Stop once past the priority size or the free threshold
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority))
+                break;
+
+            // Children waiting on this transaction can be tried again
+            for (CTxMemPool::txiter child : pool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+}
+
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end();) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit))
+            testSet.erase(iit++);
+        else
+            iit++;
+    }
+}
+
+bool BlockAssembler::TestPackage(uint64_t packageSize)
+{
+    return nBlockSize + packageSize < nBlockMaxSize;
+}
+
+bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+{
+    unsigned int nPackageSigOps = 0;
+    for (CTxMemPool::txiter it : package) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+        nPackageSigOps += it->GetSigOpCount();
+    }
+    return nBlockSigOps + nPackageSigOps < MAX_BLOCK_SIGOPS;
+}
+
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx)
+{
+    // Entries in mapModifiedTx are considered through it, with their updated totals
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries)
+{
+    // A transaction has more ancestors than any of its own ancestors, so this puts parents first
+    sortedEntries.clear();
+    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
+    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    for (CTxMemPool::txiter it : alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        pool.CalculateDescendants(it, descendants);
+        // Take the added transaction out of the package totals of its descendants
+        for (CTxMemPool::txiter desc : descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+void BlockAssembler::addPackageTxs()
+{
+    // Descendants of transactions already in the block, with those ancestors taken out
+    indexed_modified_transaction_set mapModifiedTx;
+    // Packages from mapModifiedTx that did not fit
+    CTxMemPool::setEntries failedTx;
+
+    // Start with the descendants of the priority transactions
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    // Once the block is nearly full, give up after this many packages in a row fail to fit
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = pool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != pool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // Skip mapTx entries that are stale
+        if (mi != pool.mapTx.get<ancestor_score>().end() &&
+            SkipMapTxEntry(pool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Take the better of the next mapTx entry and the best mapModifiedTx entry
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == pool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            iter = pool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
+        }
+
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+        }
+
+        // Everything left pays a lower fee rate
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            return;
+
+        if (!TestPackage(packageSize)) {
+            if (fUsingModified) {
+                // The best modified entry is looked at every iteration, so a failed one has to go
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000)
+                break;
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        pool.CalculateMemPoolAncestors(*iter, ancestors, false);
+        onlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
+
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, sortedEntries);
+
+        if (!TestPackageTransactions(ancestors) || !TestPackageInputs(sortedEntries)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
+
+        nConsecutiveFailed = 0;
+
+        for (size_t i = 0; i < sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i], sortedEntries[i]->GetPriority(nHeight));
+            mapModifiedTx.erase(sortedEntries[i]);
         }
+
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
     }
-};
+}
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -127,195 +445,25 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         pblock->vtx.push_back(CTransaction(txCoinStake));
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
     int nHeight;
-    uint64_t nBlockSize = 1000;
-    uint64_t nBlockTx = 0;
-    int nBlockSigOps = 100;
-    bool fSortedByFee = (nBlockPrioritySize <= 0);
     CBlockIndex* pindexPrev;
     {
         LOCK2(cs_main, mempool.cs);
 
         pindexPrev = chainActive.Tip();
         nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                for (COrphan* porphan : mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        int64_t nTimeStart = GetTimeMicros();
+        BlockAssembler assembler(mempool, pblocktemplate.get(), nHeight);
+        assembler.AddMempoolTransactions();
+        nFees = assembler.GetFees();
+        nLastBlockTx = assembler.GetBlockTx();
+        nLastBlockSize = assembler.GetBlockSize();
+        LogPrint("bench", "CreateNewBlock() : %u of %u mempool txs (%u bytes) selected in %.2fms\n",
+            nLastBlockTx, mempool.size(), nLastBlockSize, 0.001 * (GetTimeMicros() - nTimeStart));
     }
 
     txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
@@ -374,9 +522,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         }
     }
 
-    nLastBlockTx = nBlockTx;
-    nLastBlockSize = nBlockSize;
-    //LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    //LogPrintf("CreateNewBlock(): total size %u\n", nLastBlockSize);
 
     // Fill in header
     pblock->hashPrevBlock = pindexPrev->GetBlockHash();
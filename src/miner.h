@@ -6,8 +6,13 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "txmempool.h"
+
 #include <stdint.h>
 
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
@@ -17,6 +22,114 @@ class CWallet;
 
 struct CBlockTemplate;
 
+/**
+ * A mempool entry whose package totals exclude the ancestors already selected for the block.
+ * Only descendants of selected transactions need one; everything else is read off
+ * the mempool's ancestor score index directly.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
+
+/** Same order as CompareTxMemPoolEntryByAncestorFee, on the modified totals */
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+/**
+ * Fills a block template from the mempool. The mempool keeps its entries ordered by
+ * ancestor package fee rate as transactions come and go, so assembly walks that index
+ * from the top and stops once the block is full, instead of scoring the whole pool.
+ */
+class BlockAssembler
+{
+private:
+    CTxMemPool& pool;
+    CBlockTemplate* pblocktemplate;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    int nHeight;
+    bool fPrintPriority;
+
+    // Chain coins with the block's transactions applied, to check each package's inputs against
+    CCoinsViewCache view;
+
+    void AddToBlock(CTxMemPool::txiter iter, double dPriority);
+    bool TestPackageInputs(const std::vector<CTxMemPool::txiter>& sortedEntries);
+
+    // Priority space, filled from each entry's cached priority
+    void addPriorityTxs();
+    bool isStillDependent(CTxMemPool::txiter iter);
+    bool TestForBlock(CTxMemPool::txiter iter);
+
+    // Fee rate space, filled by ancestor package
+    void addPackageTxs();
+    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    bool TestPackage(uint64_t packageSize);
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx);
+    void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries);
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+
+public:
+    BlockAssembler(CTxMemPool& poolIn, CBlockTemplate* pblocktemplateIn, int nHeightIn);
+    /** Append the selected transactions to the template's block; cs_main and pool.cs must be held */
+    void AddMempoolTransactions();
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+};
+
 /** Run the miner threads */
 void GenerateVKCs(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
@@ -90,9 +90,7 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache(DEFAULT_MAX_RELAY_CACHE_SIZE * 1000000, RELAY_CACHE_EXPIRY);
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -1405,7 +1403,7 @@ void ThreadMessageHandler()
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWork.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
                     }
@@ -1715,27 +1713,23 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    // A rebroadcast reuses the payload that is already cached
+    CRelayCache::CPayloadRef payload;
+    if (!relayCache.Exists(CInv(MSG_TX, tx.GetHash()))) {
+        std::shared_ptr<CDataStream> ss = std::make_shared<CDataStream>(SER_NETWORK, PROTOCOL_VERSION);
+        ss->reserve(10000);
+        *ss << tx;
+        payload = ss;
+    }
+    RelayTransaction(tx, payload);
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CRelayCache::CPayloadRef& payload)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+    if (payload)
+        relayCache.Insert(inv, payload, GetTime());
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
     LOCK(cs_vNodes);
     for (CNode* pnode : vNodes) {
         if (!pnode->fRelayTxes)
@@ -1749,6 +1743,95 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     }
 }
 
+CRelayCache::CInvHasher::CInvHasher() : salt(GetRandHash()) {}
+
+CRelayCache::CRelayCache(size_t nMaxBytesIn, int64_t nExpiryIn) : nBytes(0), nMaxBytes(nMaxBytesIn), nExpiry(nExpiryIn), nHits(0), nMisses(0) {}
+
+void CRelayCache::EraseOldest()
+{
+    PayloadMap::iterator it = mapPayloads.find(vExpiration.front().second);
+    if (it != mapPayloads.end()) {
+        nBytes -= it->second->size();
+        mapPayloads.erase(it);
+    }
+    vExpiration.pop_front();
+}
+
+void CRelayCache::Insert(const CInv& inv, const CPayloadRef& payload, int64_t nNow)
+{
+    LOCK(cs);
+    // Expire old relay messages
+    while (!vExpiration.empty() && vExpiration.front().first < nNow)
+        EraseOldest();
+
+    // Keep the original serialized message so newer versions are preserved
+    if (!mapPayloads.insert(std::make_pair(inv, payload)).second)
+        return;
+    nBytes += payload->size();
+    vExpiration.push_back(std::make_pair(nNow + nExpiry, inv));
+
+    while (nBytes > nMaxBytes && !vExpiration.empty())
+        EraseOldest();
+}
+
+CRelayCache::CPayloadRef CRelayCache::Find(const CInv& inv)
+{
+    LOCK(cs);
+    PayloadMap::const_iterator it = mapPayloads.find(inv);
+    if (it == mapPayloads.end()) {
+        ++nMisses;
+        return CPayloadRef();
+    }
+    ++nHits;
+    return it->second;
+}
+
+bool CRelayCache::Exists(const CInv& inv) const
+{
+    LOCK(cs);
+    return mapPayloads.count(inv) > 0;
+}
+
+void CRelayCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    while (nBytes > nMaxBytes && !vExpiration.empty())
+        EraseOldest();
+}
+
+void CRelayCache::Clear()
+{
+    LOCK(cs);
+    mapPayloads.clear();
+    vExpiration.clear();
+    nBytes = 0;
+}
+
+size_t CRelayCache::Size() const
+{
+    LOCK(cs);
+    return mapPayloads.size();
+}
+
+size_t CRelayCache::GetBytes() const
+{
+    LOCK(cs);
+    return nBytes;
+}
+
+uint64_t CRelayCache::GetHits() const
+{
+    LOCK(cs);
+    return nHits;
+}
+
+uint64_t CRelayCache::GetMisses() const
+{
+    LOCK(cs);
+    return nMisses;
+}
+
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
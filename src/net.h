@@ -23,6 +23,7 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -32,6 +33,7 @@
 #include <boost/filesystem/path.hpp>
 
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
 
 class CAddrMan;
 class CBlockIndex;
@@ -62,6 +64,10 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Default for -maxrelaycache, maximum megabytes of serialized relay payloads kept for getdata */
+static const unsigned int DEFAULT_MAX_RELAY_CACHE_SIZE = 10;
+/** Time a relayed payload stays available for getdata (in seconds) */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -123,6 +129,61 @@ void SetReachable(enum Network net, bool fFlag = true);
 CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 
+/**
+ * Serialized payloads of recently relayed inventory. Each payload is
+ * serialized once and the same buffer is sent to every peer that asks for
+ * it. Entries expire after a fixed time, and the oldest are dropped early
+ * when the payloads exceed the byte budget.
+ */
+class CRelayCache
+{
+public:
+    typedef std::shared_ptr<const CDataStream> CPayloadRef;
+
+    CRelayCache(size_t nMaxBytesIn, int64_t nExpiryIn);
+
+    //! Remember the payload for inv unless it is already cached
+    void Insert(const CInv& inv, const CPayloadRef& payload, int64_t nNow);
+    //! Look up the payload for inv for a getdata, counting the hit or miss
+    CPayloadRef Find(const CInv& inv);
+    bool Exists(const CInv& inv) const;
+    void SetMaxBytes(size_t nMaxBytesIn);
+    void Clear();
+
+    size_t Size() const;
+    size_t GetBytes() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+
+private:
+    class CInvHasher
+    {
+    private:
+        uint256 salt;
+
+    public:
+        CInvHasher();
+        size_t operator()(const CInv& inv) const { return inv.hash.GetHash(salt) ^ inv.type; }
+    };
+
+    struct CInvEqual {
+        bool operator()(const CInv& a, const CInv& b) const { return a.type == b.type && a.hash == b.hash; }
+    };
+
+    typedef boost::unordered_map<CInv, CPayloadRef, CInvHasher, CInvEqual> PayloadMap;
+
+    void EraseOldest();
+
+    mutable CCriticalSection cs;
+    PayloadMap mapPayloads;
+    std::deque<std::pair<int64_t, CInv> > vExpiration;
+    size_t nBytes;
+    size_t nMaxBytes;
+    int64_t nExpiry;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
 extern bool fDiscover;
 extern bool fListen;
 extern uint64_t nLocalServices;
@@ -132,9 +193,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+extern CRelayCache relayCache;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -229,6 +288,8 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    //! Orphan transactions whose parents arrived from this peer, to be retried
+    std::set<uint256> setOrphanWork;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -658,7 +719,7 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CRelayCache::CPayloadRef& payload);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
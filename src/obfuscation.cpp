@@ -392,6 +392,38 @@ void CObfuscationPool::Reset()
     SetNull();
 }
 
+void CObfuscationPool::AddSessionEntry(const CObfuScationEntry& entry)
+{
+    size_t nEntry = entries.size();
+    entries.push_back(entry);
+
+    for (const CTxOut& out : entry.vout)
+        txSession.vout.push_back(out);
+
+    for (const CTxDSIn& s : entry.sev) {
+        mapSessionInputs[s.prevout] = txSession.vin.size();
+        vecSessionInputEntry.push_back(nEntry);
+        txSession.vin.push_back(s);
+        setSessionScriptSigs.insert(Hash(s.scriptSig.begin(), s.scriptSig.end()));
+        if (!s.fHasSig) nSessionSigsMissing++;
+    }
+}
+
+void CObfuscationPool::RebuildSessionIndex()
+{
+    std::vector<CObfuScationEntry> vecEntries;
+    vecEntries.swap(entries);
+
+    txSession = CMutableTransaction();
+    mapSessionInputs.clear();
+    vecSessionInputEntry.clear();
+    setSessionScriptSigs.clear();
+    nSessionSigsMissing = 0;
+
+    for (const CObfuScationEntry& entry : vecEntries)
+        AddSessionEntry(entry);
+}
+
 void CObfuscationPool::SetNull()
 {
     // MN side
@@ -411,6 +443,8 @@ void CObfuscationPool::SetNull()
     entries.clear();
     finalTransaction.vin.clear();
     finalTransaction.vout.clear();
+    mapFinalInputs.clear();
+    RebuildSessionIndex();
     lastTimeChanged = GetTimeMillis();
 
     // -- seed random number generator (used for ordering output lists)
@@ -539,16 +573,8 @@ void CObfuscationPool::Check()
         UpdateState(POOL_STATUS_SIGNING);
 
         if (fMasterNode) {
-            CMutableTransaction txNew;
-
-            // make our new transaction
-            for (unsigned int i = 0; i < entries.size(); i++) {
-                for (const CTxOut& v : entries[i].vout)
-                    txNew.vout.push_back(v);
-
-                for (const CTxDSIn& s : entries[i].sev)
-                    txNew.vin.push_back(s);
-            }
+            // make our new transaction from the merged session entries
+            CMutableTransaction txNew = txSession;
 
             // shuffle the outputs for improved anonymity
             std::random_shuffle(txNew.vin.begin(), txNew.vin.end(), randomizeList);
@@ -558,17 +584,19 @@ void CObfuscationPool::Check()
             LogPrint("obfuscation", "Transaction 1: %s\n", txNew.ToString());
             finalTransaction = txNew;
 
+            mapFinalInputs.clear();
+            for (size_t i = 0; i < finalTransaction.vin.size(); i++)
+                mapFinalInputs[finalTransaction.vin[i].prevout] = i;
+
             // request signatures from clients
             RelayFinalTransaction(sessionID, finalTransaction);
         }
     }
 
-    // If we have all of the signatures, try to compile the transaction
+    // If we have all of the signatures, hand the transaction over to the pool thread to commit it
     if (fMasterNode && state == POOL_STATUS_SIGNING && SignaturesComplete()) {
         LogPrint("obfuscation", "CObfuscationPool::Check() -- SIGNING\n");
         UpdateState(POOL_STATUS_TRANSMISSION);
-
-        CheckFinalTransaction();
     }
 
     // reset if we're here for 10 seconds
@@ -583,6 +611,9 @@ void CObfuscationPool::Check()
 void CObfuscationPool::CheckFinalTransaction()
 {
     if (!fMasterNode) return; // check and relay final tx only on masternode
+    if (state != POOL_STATUS_TRANSMISSION) return;
+
+    int64_t nStart = GetTimeMillis();
 
     CWalletTx txNew = CWalletTx(pwalletMain, finalTransaction);
 
@@ -647,7 +678,7 @@ void CObfuscationPool::CheckFinalTransaction()
         ChargeRandomFees();
 
         // Reset
-        LogPrint("obfuscation", "CObfuscationPool::Check() -- COMPLETED -- RESETTING\n");
+        LogPrint("obfuscation", "CObfuscationPool::Check() -- COMPLETED -- RESETTING (commit %dms)\n", GetTimeMillis() - nStart);
         SetNull();
         RelayStatus(sessionID, GetState(), GetEntriesCount(), MASTERNODE_RESET);
     }
@@ -845,11 +876,13 @@ void CObfuscationPool::CheckTimeout()
         c = 0;
 
         // check for a timeout and reset if needed
+        bool fErased = false;
         vector<CObfuScationEntry>::iterator it2 = entries.begin();
         while (it2 != entries.end()) {
             if ((*it2).IsExpired()) {
                 LogPrint("obfuscation", "CObfuscationPool::CheckTimeout() : Removing expired entry - %d\n", c);
                 it2 = entries.erase(it2);
+                fErased = true;
                 if (entries.size() == 0) {
                     UnlockCoins();
                     SetNull();
@@ -861,6 +894,7 @@ void CObfuscationPool::CheckTimeout()
                 ++it2;
             c++;
         }
+        if (fErased) RebuildSessionIndex();
 
         if (GetTimeMillis() - lastTimeChanged >= (OBFUSCATION_QUEUE_TIMEOUT * 1000) + addLagTime) {
             UnlockCoins();
@@ -914,31 +948,18 @@ void CObfuscationPool::CheckForCompleteQueue()
 // check to see if the signature is valid
 bool CObfuscationPool::SignatureValid(const CScript& newSig, const CTxIn& newVin)
 {
-    CMutableTransaction txNew;
-    txNew.vin.clear();
-    txNew.vout.clear();
-
     int found = -1;
     CScript sigPubKey = CScript();
-    unsigned int i = 0;
-
-    for (CObfuScationEntry& e : entries) {
-        for (const CTxOut& out : e.vout)
-            txNew.vout.push_back(out);
 
-        for (const CTxDSIn& s : e.sev) {
-            txNew.vin.push_back(s);
-
-            if (s == newVin) {
-                found = i;
-                sigPubKey = s.prevPubKey;
-            }
-            i++;
-        }
+    auto it = mapSessionInputs.find(newVin.prevout);
+    if (it != mapSessionInputs.end() && txSession.vin[it->second] == newVin) {
+        found = it->second;
+        sigPubKey = txSession.vin[found].prevPubKey;
     }
 
     if (found >= 0) { //might have to do this one input at a time?
         int n = found;
+        CMutableTransaction txNew = txSession;
         txNew.vin[n].scriptSig = newSig;
         LogPrint("obfuscation", "CObfuscationPool::SignatureValid() - Sign with sig %s\n", newSig.ToString().substr(0, 24));
         if (!VerifyScript(txNew.vin[n].scriptSig, sigPubKey, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, MutableTransactionSignatureChecker(&txNew, n))) {
@@ -1038,23 +1059,19 @@ bool CObfuscationPool::AddEntry(const std::vector<CTxIn>& newInput, const CAmoun
         return false;
     }
 
-    for (CTxIn in : newInput) {
+    for (const CTxIn& in : newInput) {
         LogPrint("obfuscation", "looking for vin -- %s\n", in.ToString());
-        for (const CObfuScationEntry& v : entries) {
-            for (const CTxDSIn& s : v.sev) {
-                if ((CTxIn)s == in) {
-                    LogPrint("obfuscation", "CObfuscationPool::AddEntry - found in vin\n");
-                    errorID = ERR_ALREADY_HAVE;
-                    sessionUsers--;
-                    return false;
-                }
-            }
+        if (mapSessionInputs.count(in.prevout)) {
+            LogPrint("obfuscation", "CObfuscationPool::AddEntry - found in vin\n");
+            errorID = ERR_ALREADY_HAVE;
+            sessionUsers--;
+            return false;
         }
     }
 
     CObfuScationEntry v;
     v.Add(newInput, nAmount, txCollateral, newOutput);
-    entries.push_back(v);
+    AddSessionEntry(v);
 
     LogPrint("obfuscation", "CObfuscationPool::AddEntry -- adding %s\n", newInput[0].ToString());
     errorID = MSG_ENTRIES_ADDED;
@@ -1067,13 +1084,10 @@ bool CObfuscationPool::AddScriptSig(const CTxIn& newVin)
     LogPrint("obfuscation", "CObfuscationPool::AddScriptSig -- new sig  %s\n", newVin.scriptSig.ToString().substr(0, 24));
 
 
-    for (const CObfuScationEntry& v : entries) {
-        for (const CTxDSIn& s : v.sev) {
-            if (s.scriptSig == newVin.scriptSig) {
-                LogPrint("obfuscation", "CObfuscationPool::AddScriptSig - already exists\n");
-                return false;
-            }
-        }
+    uint256 hashScriptSig = Hash(newVin.scriptSig.begin(), newVin.scriptSig.end());
+    if (setSessionScriptSigs.count(hashScriptSig)) {
+        LogPrint("obfuscation", "CObfuscationPool::AddScriptSig - already exists\n");
+        return false;
     }
 
     if (!SignatureValid(newVin.scriptSig, newVin)) {
@@ -1083,18 +1097,21 @@ bool CObfuscationPool::AddScriptSig(const CTxIn& newVin)
 
     LogPrint("obfuscation", "CObfuscationPool::AddScriptSig -- sig %s\n", newVin.ToString());
 
-    for (CTxIn& vin : finalTransaction.vin) {
-        if (newVin.prevout == vin.prevout && vin.nSequence == newVin.nSequence) {
+    auto itFinal = mapFinalInputs.find(newVin.prevout);
+    if (itFinal != mapFinalInputs.end() && itFinal->second < finalTransaction.vin.size()) {
+        CTxIn& vin = finalTransaction.vin[itFinal->second];
+        if (vin.nSequence == newVin.nSequence) {
             vin.scriptSig = newVin.scriptSig;
             vin.prevPubKey = newVin.prevPubKey;
             LogPrint("obfuscation", "CObfuScationPool::AddScriptSig -- adding to finalTransaction  %s\n", newVin.scriptSig.ToString().substr(0, 24));
         }
     }
-    for (unsigned int i = 0; i < entries.size(); i++) {
-        if (entries[i].AddSig(newVin)) {
-            LogPrint("obfuscation", "CObfuScationPool::AddScriptSig -- adding  %s\n", newVin.scriptSig.ToString().substr(0, 24));
-            return true;
-        }
+    auto itInput = mapSessionInputs.find(newVin.prevout);
+    if (itInput != mapSessionInputs.end() && entries[vecSessionInputEntry[itInput->second]].AddSig(newVin)) {
+        setSessionScriptSigs.insert(hashScriptSig);
+        nSessionSigsMissing--;
+        LogPrint("obfuscation", "CObfuScationPool::AddScriptSig -- adding  %s\n", newVin.scriptSig.ToString().substr(0, 24));
+        return true;
     }
 
     LogPrintf("CObfuscationPool::AddScriptSig -- Couldn't set sig!\n");
@@ -1104,12 +1121,7 @@ bool CObfuscationPool::AddScriptSig(const CTxIn& newVin)
 // Check to make sure everything is signed
 bool CObfuscationPool::SignaturesComplete()
 {
-    for (const CObfuScationEntry& v : entries) {
-        for (const CTxDSIn& s : v.sev) {
-            if (!s.fHasSig) return false;
-        }
-    }
-    return true;
+    return nSessionSigsMissing == 0;
 }
 
 //
@@ -1200,7 +1212,7 @@ void CObfuscationPool::SendObfuscationDenominate(std::vector<CTxIn>& vin, std::v
     // store our entry for later use
     CObfuScationEntry e;
     e.Add(vin, amount, txCollateral, vout);
-    entries.push_back(e);
+    AddSessionEntry(e);
 
     RelayIn(entries[0].sev, entries[0].amount, txCollateral, entries[0].vout);
     Check();
@@ -1841,18 +1853,13 @@ bool CObfuscationPool::CreateDenominated(CAmount nTotalValue)
 
 bool CObfuscationPool::IsCompatibleWithEntries(std::vector<CTxOut>& vout)
 {
-    if (GetDenominations(vout) == 0) return false;
+    int nDenom = GetDenominations(vout);
+    if (nDenom == 0) return false;
 
     for (const CObfuScationEntry &v : entries) {
-        LogPrintf(" IsCompatibleWithEntries %d %d\n", GetDenominations(vout), GetDenominations(v.vout));
-        /*
-        for(CTxOut o1 : vout)
-            LogPrintf(" vout 1 - %s\n", o1.ToString());
-
-        for(CTxOut o2 : v.vout)
-            LogPrintf(" vout 2 - %s\n", o2.ToString());
-*/
-        if (GetDenominations(vout) != GetDenominations(v.vout)) return false;
+        int nEntryDenom = GetDenominations(v.vout);
+        LogPrintf(" IsCompatibleWithEntries %d %d\n", nDenom, nEntryDenom);
+        if (nDenom != nEntryDenom) return false;
     }
 
     return true;
@@ -2322,6 +2329,7 @@ void ThreadCheckObfuScationPool()
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
+            obfuScationPool.CheckFinalTransaction();
 
             if (obfuScationPool.GetState() == POOL_STATUS_IDLE && c % 15 == 0) {
                 obfuScationPool.DoAutomaticDenominating();
@@ -269,6 +269,14 @@ private:
     std::vector<CObfuScationEntry> entries; // Masternode/clients entries
     CMutableTransaction finalTransaction;   // the finalized transaction ready for signing
 
+    // session indexes, kept in step with entries so per-message work doesn't rescan the pool
+    CMutableTransaction txSession;              // all entries merged in order, unsigned
+    std::map<COutPoint, size_t> mapSessionInputs; // input -> position in txSession
+    std::vector<size_t> vecSessionInputEntry;     // position in txSession -> index in entries
+    std::set<uint256> setSessionScriptSigs;       // hashes of scriptSigs present in the session
+    unsigned int nSessionSigsMissing;             // inputs still waiting for a signature
+    std::map<COutPoint, size_t> mapFinalInputs;   // input -> position in finalTransaction
+
     int64_t lastTimeChanged; // last time the 'state' changed, in UTC milliseconds
 
     unsigned int state; // should be one of the POOL_STATUS_XXX values
@@ -297,6 +305,9 @@ private:
     //debugging data
     std::string strAutoDenomResult;
 
+    void AddSessionEntry(const CObfuScationEntry& entry);
+    void RebuildSessionIndex();
+
 public:
     enum messages {
         ERR_ALREADY_HAVE,
@@ -417,6 +428,7 @@ public:
 
         LogPrintf("CObfuscationPool::UpdateState() == %d | %d \n", state, newState);
         if (state != newState) {
+            LogPrint("obfuscation", "CObfuscationPool::UpdateState() - state %d took %dms\n", state, GetTimeMillis() - lastTimeChanged);
             lastTimeChanged = GetTimeMillis();
             if (fMasterNode) {
                 RelayStatus(obfuScationPool.sessionID, newState, obfuScationPool.GetEntriesCount(), MASTERNODE_RESET);
@@ -449,6 +461,7 @@ public:
 
     /// Check for process in Obfuscation
     void Check();
+    /// Commit the fully signed transaction, run from the pool thread rather than the message handler
     void CheckFinalTransaction();
     /// Charge fees to bad actors (Charge clients a fee if they're abusive)
     void ChargeFees();
@@ -8,6 +8,7 @@
 #define BITCOIN_PRIMITIVES_TRANSACTION_H
 
 #include <list>
+#include <memory>
 
 #include "amount.h"
 #include "script/script.h"
@@ -219,6 +220,11 @@ public:
 
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
+    CTransaction(CMutableTransaction &&tx);
+
+    CTransaction(const CTransaction &tx) = default;
+    /** Take over the inputs and outputs of tx, leaving it empty. */
+    CTransaction(CTransaction &&tx);
 
     CTransaction& operator=(const CTransaction& tx);
 
@@ -326,4 +332,11 @@ struct CMutableTransaction
 
 };
 
+/** Shared immutable transaction, so the mempool, orphan pool and relay code
+ * can hold the same copy of a transaction instead of one each. */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
@@ -83,6 +83,8 @@ static const CRPCConvertParam vRPCConvertParams[] = {
     {"signrawtransaction", 2},
     {"sendrawtransaction", 1},
     {"sendrawtransaction", 2},
+    {"sendrawtransactions", 0},
+    {"sendrawtransactions", 1},
     {"gettxout", 1},
     {"gettxout", 2},
     {"lockunspent", 0},
@@ -80,6 +80,13 @@ std::string DecodeDumpString(const std::string& str)
     return ret.str();
 }
 
+/** Refuse the call up front while another rescan is running, rather than wait behind it */
+static void EnsureNoWalletRescan()
+{
+    if (pwalletMain->fScanningWallet)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: a wallet rescan is already in progress");
+}
+
 UniValue importprivkey(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 3)
@@ -98,8 +105,6 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
             "\nImport using a label and without rescan\n" + HelpExampleCli("importprivkey", "\"mykey\" \"testing\" false") +
             "\nAs a JSON-RPC call\n" + HelpExampleRpc("importprivkey", "\"mykey\", \"testing\", false"));
 
-    EnsureWalletIsUnlocked();
-
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
@@ -121,7 +126,15 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     CPubKey pubkey = key.GetPubKey();
     assert(key.VerifyPubKey(pubkey));
     CKeyID vchAddress = pubkey.GetID();
+    if (fRescan)
+        EnsureNoWalletRescan();
+
+    CBlockIndex* pindexGenesis;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
+        pindexGenesis = chainActive.Genesis();
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
@@ -136,10 +149,11 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        }
+    // the rescan takes cs_main and cs_wallet per batch of blocks
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, true);
     }
 
     return NullUniValue;
@@ -182,8 +196,13 @@ UniValue importaddress(const UniValue& params, bool fHelp)
     bool fRescan = true;
     if (params.size() > 2)
         fRescan = params[2].get_bool();
+    if (fRescan)
+        EnsureNoWalletRescan();
 
+    CBlockIndex* pindexGenesis;
     {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pindexGenesis = chainActive.Genesis();
         if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
             throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
@@ -199,41 +218,32 @@ UniValue importaddress(const UniValue& params, bool fHelp)
 
         if (!pwalletMain->AddWatchOnly(script))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, true);
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return NullUniValue;
 }
 
-UniValue importwallet(const UniValue& params, bool fHelp)
+/**
+ * Import the keys of a wallet dump file under cs_main and cs_wallet and return the block to
+ * rescan from. fGood is cleared if any key couldn't be added.
+ */
+static CBlockIndex* ImportWalletDump(const std::string& strFile, bool& fGood)
 {
-    if (fHelp || params.size() != 1)
-        throw runtime_error(
-            "importwallet \"filename\"\n"
-            "\nImports keys from a wallet dump file (see dumpwallet).\n"
-            "\nArguments:\n"
-            "1. \"filename\"    (string, required) The wallet file\n"
-            "\nExamples:\n"
-            "\nDump the wallet\n" +
-            HelpExampleCli("dumpwallet", "\"test\"") +
-            "\nImport the wallet\n" + HelpExampleCli("importwallet", "\"test\"") +
-            "\nImport using the json rpc call\n" + HelpExampleRpc("importwallet", "\"test\""));
-
+    LOCK2(cs_main, pwalletMain->cs_wallet);
     EnsureWalletIsUnlocked();
 
     ifstream file;
-    file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
+    file.open(strFile.c_str(), std::ios::in | std::ios::ate);
     if (!file.is_open())
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
 
     int64_t nTimeBegin = chainActive.Tip()->GetBlockTime();
 
-    bool fGood = true;
-
     int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
     file.seekg(0, file.beg);
 
@@ -296,7 +306,30 @@ UniValue importwallet(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    return pindex;
+}
+
+UniValue importwallet(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "importwallet \"filename\"\n"
+            "\nImports keys from a wallet dump file (see dumpwallet).\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The wallet file\n"
+            "\nExamples:\n"
+            "\nDump the wallet\n" +
+            HelpExampleCli("dumpwallet", "\"test\"") +
+            "\nImport the wallet\n" + HelpExampleCli("importwallet", "\"test\"") +
+            "\nImport using the json rpc call\n" + HelpExampleRpc("importwallet", "\"test\""));
+
+    EnsureNoWalletRescan();
+
+    bool fGood = true;
+    CBlockIndex* pindex = ImportWalletDump(params[0].get_str(), fGood);
+
+    // the rescan takes cs_main and cs_wallet per batch of blocks
+    pwalletMain->ScanForWalletTransactions(pindex, false);
     pwalletMain->MarkDirty();
 
     if (!fGood)
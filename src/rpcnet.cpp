@@ -314,7 +314,13 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"relaycache\": {        (json object) Relayed transactions kept for peers to fetch\n"
+            "    \"entries\": n,        (numeric) Number of cached payloads\n"
+            "    \"bytes\": n,          (numeric) Size of the cached payloads\n"
+            "    \"hits\": n,           (numeric) Requests served from the cache\n"
+            "    \"misses\": n          (numeric) Requests not found in the cache\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -323,6 +329,13 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue relay(UniValue::VOBJ);
+    relay.push_back(Pair("entries", (uint64_t)relayCache.Size()));
+    relay.push_back(Pair("bytes", (uint64_t)relayCache.GetBytes()));
+    relay.push_back(Pair("hits", relayCache.GetHits()));
+    relay.push_back(Pair("misses", relayCache.GetMisses()));
+    obj.push_back(Pair("relaycache", relay));
     return obj;
 }
 
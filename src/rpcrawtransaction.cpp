@@ -751,3 +751,97 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
 
     return hashTx.GetHex();
 }
+
+UniValue sendrawtransactions(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "sendrawtransactions [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits a batch of raw transactions (serialized, hex-encoded) to local node and network.\n"
+            "Transactions may spend each other's outputs and can be given in any order; their scripts\n"
+            "are verified in parallel.\n"
+            "\nArguments:\n"
+            "1. \"hexstrings\"   (array, required) The hex strings of the raw transactions\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"id\",          (string) The transaction hash in hex, empty if it could not be decoded\n"
+            "    \"accepted\" : true|false, (boolean) Whether the transaction is in the memory pool\n"
+            "    \"error\" : \"text\"         (string, optional) Why the transaction was rejected\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex\\\",\\\"signedhex\\\"]\"") +
+            HelpExampleRpc("sendrawtransactions", "[\"signedhex\",\"signedhex\"]"));
+
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VARR)(UniValue::VBOOL));
+
+    const UniValue& hexs = params[0].get_array();
+    bool fOverrideFees = false;
+    if (params.size() > 1)
+        fOverrideFees = params[1].get_bool();
+
+    std::vector<CTransactionRef> vDecoded(hexs.size());
+    std::vector<std::string> vError(hexs.size());
+    std::vector<uint256> vHash(hexs.size());
+    for (unsigned int i = 0; i < hexs.size(); i++) {
+        CTransaction tx;
+        if (!hexs[i].isStr() || !DecodeHexTx(tx, hexs[i].get_str())) {
+            vError[i] = "TX decode failed";
+            continue;
+        }
+        vHash[i] = tx.GetHash();
+        vDecoded[i] = MakeTransactionRef(std::move(tx));
+    }
+
+    std::vector<CTransactionRef> vtx;
+    std::vector<int> vIndex;
+    {
+        LOCK(cs_main);
+        CCoinsViewCache& view = *pcoinsTip;
+        for (unsigned int i = 0; i < hexs.size(); i++) {
+            if (!vDecoded[i])
+                continue;
+            const CCoins* existingCoins = view.AccessCoins(vHash[i]);
+            if (existingCoins && existingCoins->nHeight < 1000000000) {
+                vError[i] = "transaction already in block chain";
+                continue;
+            }
+            vtx.push_back(vDecoded[i]);
+            vIndex.push_back(i);
+        }
+    }
+
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    AcceptToMemoryPoolBatch(mempool, vtx, vState, vAccepted, !fOverrideFees);
+
+    std::vector<bool> vResult(hexs.size(), false);
+    for (unsigned int n = 0; n < vtx.size(); n++) {
+        int i = vIndex[n];
+        // AcceptToMemoryPool fails without a reason for transactions it already has
+        if (vAccepted[n] || (vState[n].IsValid() && mempool.exists(vHash[i]))) {
+            vResult[i] = true;
+            RelayTransaction(*vtx[n]);
+        } else if (vState[n].IsInvalid()) {
+            vError[i] = strprintf("%i: %s", vState[n].GetRejectCode(), vState[n].GetRejectReason());
+        } else if (!vState[n].GetRejectReason().empty()) {
+            vError[i] = vState[n].GetRejectReason();
+        } else {
+            vError[i] = "missing inputs or conflicting transaction";
+        }
+    }
+
+    UniValue result(UniValue::VARR);
+    for (unsigned int i = 0; i < hexs.size(); i++) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("txid", vHash[i].IsNull() ? "" : vHash[i].GetHex()));
+        entry.push_back(Pair("accepted", vResult[i]));
+        if (!vError[i].empty())
+            entry.push_back(Pair("error", vError[i]));
+        result.push_back(entry);
+    }
+    return result;
+}
@@ -310,6 +310,7 @@ static const CRPCCommand vRPCCommands[] =
         {"rawtransactions", "decodescript", &decodescript, true, false, false},
         {"rawtransactions", "getrawtransaction", &getrawtransaction, true, false, false},
         {"rawtransactions", "sendrawtransaction", &sendrawtransaction, false, false, false},
+        {"rawtransactions", "sendrawtransactions", &sendrawtransactions, false, true, false},
         {"rawtransactions", "signrawtransaction", &signrawtransaction, false, false, false}, /* uses wallet if enabled */
 
         /* Utility functions */
@@ -366,9 +367,9 @@ static const CRPCCommand vRPCCommands[] =
         {"wallet", "gettransaction", &gettransaction, false, false, true},
         {"wallet", "getunconfirmedbalance", &getunconfirmedbalance, false, false, true},
         {"wallet", "getwalletinfo", &getwalletinfo, false, false, true},
-        {"wallet", "importprivkey", &importprivkey, true, false, true},
-        {"wallet", "importwallet", &importwallet, true, false, true},
-        {"wallet", "importaddress", &importaddress, true, false, true},
+        {"wallet", "importprivkey", &importprivkey, true, true, true}, /* locks itself so the rescan doesn't hold cs_main */
+        {"wallet", "importwallet", &importwallet, true, true, true}, /* locks itself so the rescan doesn't hold cs_main */
+        {"wallet", "importaddress", &importaddress, true, true, true}, /* locks itself so the rescan doesn't hold cs_main */
         {"wallet", "keypoolrefill", &keypoolrefill, true, false, true},
         {"wallet", "listaccounts", &listaccounts, false, false, true},
         {"wallet", "listaddressgroupings", &listaddressgroupings, false, false, true},
@@ -97,9 +97,6 @@ UniValue getnewaddress(const UniValue& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -182,9 +179,6 @@ UniValue getrawchangeaddress(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getrawchangeaddress", "") + HelpExampleRpc("getrawchangeaddress", ""));
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
     if (!reservekey.GetReservedKey(vchPubKey))
@@ -738,7 +732,10 @@ UniValue movecmd(const UniValue& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!walletdb.WriteAccountingEntry(debit)) {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
 
     // Credit
     CAccountingEntry credit;
@@ -748,11 +745,18 @@ UniValue movecmd(const UniValue& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!walletdb.WriteAccountingEntry(credit)) {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // Only show the entries once both are on disk
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1284,11 +1288,10 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
 
     UniValue ret(UniValue::VARR);
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
         CWalletTx* const pwtx = (*it).second.first;
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
@@ -1453,15 +1456,16 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
         if (params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
-    int depth = pindex ? (1 + chainActive.Height() - pindex->nHeight) : -1;
-
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++) {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain(false) < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+    if (pindex) {
+        std::vector<const CWalletTx*> vwtx;
+        pwalletMain->GetTransactionsSinceHeight(pindex->nHeight, vwtx);
+        for (const CWalletTx* pwtx : vwtx)
+            ListTransactions(*pwtx, "*", 0, true, transactions, filter);
+    } else {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex* pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1925,6 +1929,12 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"rescan\": {                 (json object, only while a rescan is running)\n"
+            "    \"height\": xxxx,           (numeric) the last block scanned\n"
+            "    \"tipheight\": xxxx,        (numeric) the height the rescan runs up to\n"
+            "    \"progress\": x.xxx,        (numeric) the fraction of blocks scanned\n"
+            "    \"blockspersecond\": x.xx   (numeric) the average scan rate\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getwalletinfo", "") + HelpExampleRpc("getwalletinfo", ""));
@@ -1937,6 +1947,15 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("keypoolsize", (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+    if (pwalletMain->fScanningWallet) {
+        int nStart = pwalletMain->nScanStartHeight, nHeight = pwalletMain->nScanHeight, nTip = pwalletMain->nScanTipHeight;
+        UniValue rescan(UniValue::VOBJ);
+        rescan.push_back(Pair("height", nHeight));
+        rescan.push_back(Pair("tipheight", nTip));
+        rescan.push_back(Pair("progress", nTip > nStart ? (double)(nHeight - nStart) / (nTip - nStart) : 1.0));
+        rescan.push_back(Pair("blockspersecond", pwalletMain->GetRescanBlocksPerSecond()));
+        obj.push_back(Pair("rescan", rescan));
+    }
     return obj;
 }
 
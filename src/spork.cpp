@@ -24,10 +24,32 @@ class CSporkManager;
 CSporkManager sporkManager;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
-std::map<CBitcoinAddress, int64_t> mapFilterAddress; // address, timestamp lock from
 bool txFilterState = false;
 int txFilterTarget = 0;
 
+static std::shared_ptr<const TxFilterMap> pTxFilter = std::make_shared<const TxFilterMap>();
+
+// Current value of every known spork, refreshed whenever mapSporksActive changes
+static int64_t GetSporkDefault(int nSporkID);
+static std::atomic<int64_t> vSporkValues[SPORK_END - SPORK_START + 1];
+
+static class CSporkValuesInit
+{
+public:
+    CSporkValuesInit()
+    {
+        for (int nSporkID = SPORK_START; nSporkID <= SPORK_END; nSporkID++)
+            vSporkValues[nSporkID - SPORK_START].store(GetSporkDefault(nSporkID));
+    }
+} instance_of_csporkvaluesinit;
+
+static void SetActiveSpork(const CSporkMessage& spork)
+{
+    mapSporksActive[spork.nSporkID] = spork;
+    if (spork.nSporkID >= SPORK_START && spork.nSporkID <= SPORK_END)
+        vSporkValues[spork.nSporkID - SPORK_START].store(spork.nValue);
+}
+
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
@@ -67,7 +89,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         }
 
         mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        SetActiveSpork(spork);
         sporkManager.Relay(spork);
 
         //does a task if needed
@@ -95,29 +117,39 @@ bool IsSporkActive(int nSporkID)
 // grab the value of the spork on the network, or the default
 int64_t GetSporkValue(int nSporkID)
 {
+    if (nSporkID >= SPORK_START && nSporkID <= SPORK_END)
+        return vSporkValues[nSporkID - SPORK_START].load();
+
     int64_t r = -1;
 
     if (mapSporksActive.count(nSporkID)) {
         r = mapSporksActive[nSporkID].nValue;
     } else {
-        if (nSporkID == SPORK_1_SWIFTTX) r = SPORK_1_SWIFTTX_DEFAULT;
-        if (nSporkID == SPORK_2_SWIFTTX_BLOCK_FILTERING) r = SPORK_2_SWIFTTX_BLOCK_FILTERING_DEFAULT;
-        if (nSporkID == SPORK_3_MAX_VALUE) r = SPORK_3_MAX_VALUE_DEFAULT;
-        if (nSporkID == SPORK_4_MASTERNODE_PAYMENT_ENFORCEMENT) r = SPORK_4_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_5_RECONSIDER_BLOCKS) r = SPORK_5_RECONSIDER_BLOCKS_DEFAULT;
-        if (nSporkID == SPORK_6_MN_WINNER_MINIMUM_AGE) r = SPORK_6_MN_WINNER_MINIMUM_AGE_DEFAULT;
-        if (nSporkID == SPORK_7_MN_REBROADCAST_ENFORCEMENT) r = SPORK_7_MN_REBROADCAST_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_8_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_8_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_9_TX_FILTERING_ENFORCEMENT) r = SPORK_9_TX_FILTERING_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_10_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_10_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
-        if (nSporkID == SPORK_11_DEV_FEE) r = SPORK_11_DEV_FEE_DEFAULT;
-
-        if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
+        LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
     }
 
     return r;
 }
 
+static int64_t GetSporkDefault(int nSporkID)
+{
+    int64_t r = -1;
+
+    if (nSporkID == SPORK_1_SWIFTTX) r = SPORK_1_SWIFTTX_DEFAULT;
+    if (nSporkID == SPORK_2_SWIFTTX_BLOCK_FILTERING) r = SPORK_2_SWIFTTX_BLOCK_FILTERING_DEFAULT;
+    if (nSporkID == SPORK_3_MAX_VALUE) r = SPORK_3_MAX_VALUE_DEFAULT;
+    if (nSporkID == SPORK_4_MASTERNODE_PAYMENT_ENFORCEMENT) r = SPORK_4_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_5_RECONSIDER_BLOCKS) r = SPORK_5_RECONSIDER_BLOCKS_DEFAULT;
+    if (nSporkID == SPORK_6_MN_WINNER_MINIMUM_AGE) r = SPORK_6_MN_WINNER_MINIMUM_AGE_DEFAULT;
+    if (nSporkID == SPORK_7_MN_REBROADCAST_ENFORCEMENT) r = SPORK_7_MN_REBROADCAST_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_8_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_8_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_9_TX_FILTERING_ENFORCEMENT) r = SPORK_9_TX_FILTERING_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_10_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_10_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
+    if (nSporkID == SPORK_11_DEV_FEE) r = SPORK_11_DEV_FEE_DEFAULT;
+
+    return r;
+}
+
 void ExecuteSpork(int nSporkID, int64_t nValue)
 {
     //correct fork via spork technology
@@ -130,45 +162,83 @@ void ExecuteSpork(int nSporkID, int64_t nValue)
     }
 }
 
+std::shared_ptr<const TxFilterMap> GetTxFilter()
+{
+    return std::atomic_load(&pTxFilter);
+}
+
+static void PublishTxFilter(TxFilterMap mapFilter)
+{
+    std::shared_ptr<const TxFilterMap> pfilter = std::make_shared<const TxFilterMap>(std::move(mapFilter));
+    std::atomic_store(&pTxFilter, pfilter);
+}
+
+static void AddFilterAddress(TxFilterMap& mapFilter, const std::string& strAddress, int64_t nTimeFrom)
+{
+    // addresses that don't decode on this network can never match a spent output
+    CBitcoinAddress address(strAddress);
+    if (address.IsValid())
+        mapFilter.emplace(address.Get(), nTimeFrom);
+}
+
 // TODO: create own class for the tx filter
-void InitTxFilter()
+static TxFilterMap GetInitialTxFilter()
 {
-    std::vector<std::string> pba {        
+    std::vector<std::string> pba {
         "e9qbu4ajGFunL9SZZxvcSTmjy92AmkE76V" // place holder address, not in this chain
     };
-    mapFilterAddress.clear();
+    TxFilterMap mapFilter;
 
     if (Params().NetworkID() == CBaseChainParams::MAIN) {
-        mapFilterAddress.emplace( CBitcoinAddress("e9S3j4pxUHZbKpQfBr5S9Th6W4j4E5kt8a"), 1545731364 ); // Placeholder address, not in this chain
+        AddFilterAddress(mapFilter, "e9S3j4pxUHZbKpQfBr5S9Th6W4j4E5kt8a", 1545731364); // Placeholder address, not in this chain
         for (auto item : pba)
-            mapFilterAddress.emplace( CBitcoinAddress(item), 1609459200 );
+            AddFilterAddress(mapFilter, item, 1609459200);
 
     } else if (Params().NetworkID() == CBaseChainParams::TESTNET) {
-        mapFilterAddress.emplace( CBitcoinAddress("xQpcdxugd9qdMGq93vvC5CpKF3pUo8bEg1"), 1552518900 ); // testing
+        AddFilterAddress(mapFilter, "xQpcdxugd9qdMGq93vvC5CpKF3pUo8bEg1", 1552518900); // testing
     }
+    return mapFilter;
 }
 
-void BuildTxFilter()
+void InitTxFilter()
 {
-    LOCK(cs_main);
+    PublishTxFilter(GetInitialTxFilter());
+}
 
-    InitTxFilter();
-    CBitcoinAddress Address;
+void BuildTxFilter()
+{
+    TxFilterMap mapFilter = GetInitialTxFilter();
     CTxDestination Dest;
 
     CBlock referenceBlock;
     uint64_t sporkBlockValue = (GetSporkValue(SPORK_9_TX_FILTERING_ENFORCEMENT) >> 32) & 0xffffffff; // 32-bit block number
 
-    txFilterTarget = sporkBlockValue; // set filter targed on spork recived
-    if (txFilterTarget == 0) {
-        // no target block, return
-        txFilterState = true;
-        return;
+    // The previous snapshot stays live until the complete filter is published
+    CDiskBlockPos posReference;
+    {
+        LOCK(cs_main);
+        txFilterTarget = sporkBlockValue; // set filter targed on spork recived
+        if (txFilterTarget == 0) {
+            // no target block, return
+            PublishTxFilter(std::move(mapFilter));
+            txFilterState = true;
+            return;
+        }
+
+        CBlockIndex* referenceIndex = chainActive[sporkBlockValue];
+        if (referenceIndex == NULL) {
+            PublishTxFilter(std::move(mapFilter));
+            return;
+        }
+        posReference = referenceIndex->GetBlockPos();
     }
 
-    CBlockIndex *referenceIndex = chainActive[sporkBlockValue];
-    if (referenceIndex != NULL) {
-        assert(ReadBlockFromDisk(referenceBlock, referenceIndex));
+    // the reference block is read without holding cs_main
+    {
+        if (!ReadBlockFromDisk(referenceBlock, posReference)) {
+            LogPrintf("%s: failed to read reference block %d\n", __func__, sporkBlockValue);
+            return;
+        }
         int sporkMask = GetSporkValue(SPORK_9_TX_FILTERING_ENFORCEMENT) & 0xffffffff; // 32-bit tx mask
         int nAddressCount = 0;
 
@@ -178,18 +248,20 @@ void BuildTxFilter()
             if (((sporkMask >> i) & 0x1) != 0) {
                 for (unsigned int j = 0; j < referenceBlock.vtx[i].vout.size(); j++) {
                     if (referenceBlock.vtx[i].vout[j].nValue > 0) {
-                        ExtractDestination(referenceBlock.vtx[i].vout[j].scriptPubKey, Dest);
-                        Address.Set(Dest);
-                        auto it  = mapFilterAddress.emplace(Address, referenceBlock.GetBlockTime());
+                        if (!ExtractDestination(referenceBlock.vtx[i].vout[j].scriptPubKey, Dest))
+                            continue;
+                        auto it = mapFilter.emplace(Dest, referenceBlock.GetBlockTime());
                         nAddressCount++;
                         if (fDebug && it.second)
                             LogPrintf("BuildTxFilter(): Add Tx filter address %d in reference block %ld, %s\n",
-                                          nAddressCount, sporkBlockValue, Address.ToString());
+                                          nAddressCount, sporkBlockValue, CBitcoinAddress(Dest).ToString());
                     }
                 }
             }
         }
         // filter initialization completed
+        LOCK(cs_main);
+        PublishTxFilter(std::move(mapFilter));
         txFilterState = true;
         LogPrintf("%s: Tx filter initialized, %d addresses\n", __func__, nAddressCount);
     }
@@ -288,7 +360,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
     if (Sign(msg)) {
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
-        mapSporksActive[nSporkID] = msg;
+        SetActiveSpork(msg);
         return true;
     }
 
@@ -18,8 +18,12 @@
 
 #include "obfuscation.h"
 #include "protocol.h"
+#include "script/standard.h"
 #include <boost/lexical_cast.hpp>
 
+#include <atomic>
+#include <memory>
+
 using namespace std;
 using namespace boost;
 
@@ -63,8 +67,6 @@ class CSporkManager;
 extern CSporkManager sporkManager;
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
-//extern std::set<CBitcoinAddress> setFilterAddress;
-extern std::map<CBitcoinAddress, int64_t> mapFilterAddress;
 extern bool txFilterState;
 extern int txFilterTarget;
 
@@ -76,6 +78,11 @@ void ReprocessBlocks(int nBlocks);
 void InitTxFilter();
 void BuildTxFilter();
 
+/** Filtered destinations and the time they are filtered from. Published as an immutable
+ *  snapshot so CheckTxFilter can read it without cs_main. */
+typedef std::map<CTxDestination, int64_t> TxFilterMap;
+std::shared_ptr<const TxFilterMap> GetTxFilter();
+
 //
 // Spork Class
 // Keeps track of all of the network spork settings
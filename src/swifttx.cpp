@@ -21,14 +21,53 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
+boost::unordered_map<uint256, CTransaction, CTxLockHasher> mapTxLockReq;
+boost::unordered_map<uint256, CTransaction, CTxLockHasher> mapTxLockReqRejected;
+boost::unordered_map<uint256, CConsensusVote, CTxLockHasher> mapTxLockVote;
+boost::unordered_map<uint256, CTransactionLock, CTxLockHasher> mapTxLocks;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// inputs of completed locks, read by block and mempool validation under a shared lock
+boost::unordered_map<COutPoint, uint256, CTxLockHasher> mapLockedInputs;
+boost::shared_mutex cs_mapLockedInputs;
+
+// lock expiration times, so cleanup only visits expired locks
+std::multimap<int64_t, uint256> mapTxLockExpiry;
+
+CTxLockHasher::CTxLockHasher() : salt(GetRandHash()) {}
+
+static void SetLockExpiration(CTransactionLock& txLock, int64_t nExpiration)
+{
+    txLock.nExpiration = nExpiration;
+    mapTxLockExpiry.insert(make_pair(nExpiration, txLock.txHash));
+}
+
+static void LockInputs(const CTransaction& tx, const uint256& txHash)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_mapLockedInputs);
+    for (const CTxIn& in : tx.vin)
+        mapLockedInputs.emplace(in.prevout, txHash);
+}
+
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockTx)
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_mapLockedInputs);
+    if (mapLockedInputs.empty())
+        return false;
+
+    uint256 txHash = tx.GetHash();
+    for (const CTxIn& in : tx.vin) {
+        auto it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != txHash) {
+            hashLockTx = it->second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -100,14 +139,10 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
-            for (const CTxIn& in : tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
+            LockInputs(tx, tx.GetHash());
 
             // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+            auto i = mapTxLocks.find(tx.GetHash());
             if (i != mapTxLocks.end()) {
                 //we only care if we have a complete tx lock
                 if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
@@ -239,17 +274,18 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
-    if (!mapTxLocks.count(tx.GetHash())) {
+    auto i = mapTxLocks.find(tx.GetHash());
+    if (i == mapTxLocks.end()) {
         LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
 
         CTransactionLock newLock;
         newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
+        SetLockExpiration(newLock, GetTime() + (60 * 60)); //locks expire after 60 minutes (24 confirmations)
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
     } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
+        i->second.nBlockHeight = nBlockHeight;
         LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
     }
 
@@ -331,15 +367,15 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
+        SetLockExpiration(newLock, GetTime() + (60 * 60));
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
     } else
         LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
+    auto i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()) {
         (*i).second.AddSignature(ctx);
 
@@ -367,11 +403,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 #endif
 
                 if (mapTxLockReq.count(ctx.txHash)) {
-                    for (const CTxIn& in : tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
+                    LockInputs(tx, ctx.txHash);
                 }
 
                 // resolve conflicts
@@ -399,15 +431,14 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
-    for (const CTxIn& in : tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
-        }
+    uint256 hashLockTx;
+    if (FindConflictingLock(tx, hashLockTx)) {
+        LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), hashLockTx.ToString().c_str());
+        auto i = mapTxLocks.find(tx.GetHash());
+        if (i != mapTxLocks.end()) SetLockExpiration(i->second, GetTime());
+        i = mapTxLocks.find(hashLockTx);
+        if (i != mapTxLocks.end()) SetLockExpiration(i->second, GetTime());
+        return true;
     }
 
     return false;
@@ -432,30 +463,42 @@ void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    int64_t nNow = GetTime();
+    auto itExpiry = mapTxLockExpiry.begin();
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    for (; itExpiry != mapTxLockExpiry.end() && itExpiry->first < nNow; ++itExpiry) {
+        auto it = mapTxLocks.find(itExpiry->second);
+        // the lock may be gone already or have been recreated since
+        if (it == mapTxLocks.end() || nNow <= it->second.nExpiration)
+            continue;
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
-
-                for (const CTxIn& in : tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+#ifdef ENABLE_WALLET
+        // the locked depth no longer counts towards the wallet's balances
+        if (pwalletMain)
+            pwalletMain->UpdatedTransaction(it->second.txHash);
+#endif
 
-                for (CConsensusVote& v : it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
+        auto itReq = mapTxLockReq.find(it->second.txHash);
+        if (itReq != mapTxLockReq.end()) {
+            {
+                boost::unique_lock<boost::shared_mutex> lock(cs_mapLockedInputs);
+                for (const CTxIn& in : itReq->second.vin)
+                    mapLockedInputs.erase(in.prevout);
             }
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(it->second.txHash);
+
+            for (const CConsensusVote& v : it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
+
+    mapTxLockExpiry.erase(mapTxLockExpiry.begin(), itExpiry);
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -541,6 +584,7 @@ bool CTransactionLock::SignaturesValid()
 void CTransactionLock::AddSignature(CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    mapVoteCount[cv.nBlockHeight]++;
 }
 
 int CTransactionLock::CountSignatures()
@@ -552,11 +596,6 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
-    int n = 0;
-    for (CConsensusVote v : vecConsensusVotes) {
-        if (v.nBlockHeight == nBlockHeight) {
-            n++;
-        }
-    }
-    return n;
+    auto it = mapVoteCount.find(nBlockHeight);
+    return it == mapVoteCount.end() ? 0 : it->second;
 }
@@ -28,6 +28,9 @@
 #define SWIFTTX_SIGNATURES_REQUIRED 6
 #define SWIFTTX_SIGNATURES_TOTAL 10
 
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+
 using namespace std;
 using namespace boost;
 
@@ -38,11 +41,30 @@ class CTransactionLock;
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 static const CAmount MIN_SWIFTTX_FEE = 10000000;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
+/** Salted hasher for the lock tables, their keys are chosen by peers */
+class CTxLockHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CTxLockHasher();
+
+    size_t operator()(const uint256& key) const
+    {
+        return key.GetHash(salt);
+    }
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return outpoint.hash.GetHash(salt) + outpoint.n;
+    }
+};
+
+extern boost::unordered_map<uint256, CTransaction, CTxLockHasher> mapTxLockReq;
+extern boost::unordered_map<uint256, CTransaction, CTxLockHasher> mapTxLockReqRejected;
+extern boost::unordered_map<uint256, CConsensusVote, CTxLockHasher> mapTxLockVote;
+extern boost::unordered_map<uint256, CTransactionLock, CTxLockHasher> mapTxLocks;
 extern int nCompleteTXLocks;
 
 
@@ -53,6 +75,9 @@ bool IsIXTXValid(const CTransaction& txCollateral);
 // if two conflicting locks are approved by the network, they will cancel out
 bool CheckForConflictingLocks(CTransaction& tx);
 
+// find an input of tx that is locked by another transaction, only takes a shared lock
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockTx);
+
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
@@ -97,6 +122,7 @@ public:
     int nBlockHeight;
     uint256 txHash;
     std::vector<CConsensusVote> vecConsensusVotes;
+    std::map<int, int> mapVoteCount; // votes per block height, counted as they are added
     int nExpiration;
     int nTimeout;
 
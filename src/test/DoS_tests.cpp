@@ -24,15 +24,18 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
 extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, std::set<uint256> > mapOrphanTransactionsByPeer;
+extern size_t nOrphanTransactionsSize;
 
 CService ip(uint32_t i)
 {
@@ -112,7 +115,7 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -134,7 +137,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -151,7 +154,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
@@ -175,7 +178,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
     }
 
     // Test EraseOrphansFor:
@@ -193,7 +196,68 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0);
+}
+
+static CTransactionRef MakeOrphan(const CScript& scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    for (unsigned int j = 0; j < tx.vin.size(); j++) {
+        tx.vin[j].prevout.n = j;
+        tx.vin[j].prevout.hash = GetRandHash();
+        tx.vin[j].scriptSig << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    return MakeTransactionRef(std::move(tx));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // A single peer cannot hold more than its share of the pool
+    for (unsigned int i = 0; i < 2 * MAX_ORPHAN_TRANSACTIONS_PER_PEER; i++)
+        BOOST_CHECK(AddOrphanTx(MakeOrphan(scriptPubKey), 0));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[0].size(), MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+
+    // Eviction takes from the peer holding the most orphans
+    BOOST_CHECK(AddOrphanTx(MakeOrphan(scriptPubKey), 1));
+    LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS_PER_PEER);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[1].size(), 1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByPeer[0].size(), MAX_ORPHAN_TRANSACTIONS_PER_PEER - 1);
+
+    // Orphans expire
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    LimitOrphanTxSize(DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0);
+
+    // Orphan-heavy relay: many peers each filling their share
+    const int nPeers = 200;
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < nPeers * (int)MAX_ORPHAN_TRANSACTIONS_PER_PEER; i++)
+        vtx.push_back(MakeOrphan(scriptPubKey));
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        AddOrphanTx(vtx[i], i % nPeers);
+        LimitOrphanTxSize(1000000);
+    }
+    BOOST_CHECK(!mapOrphanTransactions.empty());
+    BOOST_CHECK(nOrphanTransactionsSize <= MAX_ORPHAN_TRANSACTIONS_SIZE);
+    for (NodeId i = 0; i < nPeers; i++)
+        EraseOrphansFor(i);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
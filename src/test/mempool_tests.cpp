@@ -2,13 +2,57 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "keystore.h"
 #include "main.h"
+#include "miner.h"
+#include "script/sign.h"
 #include "txmempool.h"
 #include "util.h"
+#include "utiltime.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
+/** A fresh key with coins in pcoinsTip, cleared again when it goes out of scope */
+class FundedKey
+{
+public:
+    CBasicKeyStore keystore;
+    CKey key;
+    CScript scriptPubKey;
+    CTransaction txFund;
+
+    /** Fund nOutputs outputs of nValue each, paying to the key unless scriptPubKeyIn is given */
+    FundedKey(unsigned int nOutputs, CAmount nValue, const CScript& scriptPubKeyIn = CScript())
+    {
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        // Spend a made-up output unique to the key, so no two tests fund the same coins
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = key.GetPubKey().GetHash();
+        tx.vin[0].prevout.n = 0;
+        tx.vout.resize(nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i++) {
+            tx.vout[i].scriptPubKey = scriptPubKeyIn.empty() ? scriptPubKey : scriptPubKeyIn;
+            tx.vout[i].nValue = nValue;
+        }
+        txFund = CTransaction(tx);
+
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFund.GetHash())->FromTx(txFund, chainActive.Height());
+    }
+
+    ~FundedKey()
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFund.GetHash())->Clear();
+    }
+};
+
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
 BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
@@ -58,17 +102,17 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(removed.size(), 0);
 
     // Just the parent:
-    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1, 1));
     testPool.remove(txParent, removed, true);
     BOOST_CHECK_EQUAL(removed.size(), 1);
     removed.clear();
     
     // Parent, children, grandchildren:
-    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1, 1));
     for (int i = 0; i < 3; i++)
     {
-        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1));
-        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1));
+        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1, 1));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1, 1));
     }
     // Remove Child[0], GrandChild[0] should be removed:
     testPool.remove(txChild[0], removed, true);
@@ -88,8 +132,8 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     // Add children and grandchildren, but NOT the parent (simulate the parent being in a block)
     for (int i = 0; i < 3; i++)
     {
-        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1));
-        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1));
+        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1, 1));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), CTxMemPoolEntry(txGrandChild[i], 0, 0, 0.0, 1, 1));
     }
     // Now remove the parent, as might happen if a block-re-org occurs but the parent cannot be
     // put into the mempool (maybe because it is non-standard):
@@ -99,4 +143,559 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolPackageStateTest)
+{
+    // Parent with two children, one of which has a child of its own:
+    // totals with ancestors and descendants follow adds, removes and fee deltas
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++)
+    {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout.hash = txParent.GetHash();
+        txChild[i].vin[0].prevout.n = i;
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+    }
+    CMutableTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild[0].GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txChild[0].GetHash(), CTxMemPoolEntry(txChild[0], 2000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txChild[1].GetHash(), CTxMemPoolEntry(txChild[1], 3000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 4000, 0, 0.0, 1, 1));
+
+    LOCK(testPool.cs);
+    CTxMemPool::txiter parentit = testPool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter child0it = testPool.mapTx.find(txChild[0].GetHash());
+    CTxMemPool::txiter grandchildit = testPool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(parentit->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(parentit->GetModFeesWithDescendants(), 10000);
+    BOOST_CHECK_EQUAL(child0it->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(child0it->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandchildit->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(grandchildit->GetModFeesWithAncestors(), 7000);
+    BOOST_CHECK_EQUAL(grandchildit->GetSizeWithAncestors(), parentit->GetTxSize() + child0it->GetTxSize() + grandchildit->GetTxSize());
+    BOOST_CHECK_EQUAL(testPool.GetMemPoolChildren(parentit).size(), 2);
+
+    // A fee delta moves the package totals on both sides
+    testPool.PrioritiseTransaction(txChild[0].GetHash(), txChild[0].GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(child0it->GetModifiedFee(), 2500);
+    BOOST_CHECK_EQUAL(parentit->GetModFeesWithDescendants(), 10500);
+    BOOST_CHECK_EQUAL(grandchildit->GetModFeesWithAncestors(), 7500);
+
+    // The parent confirms: its descendants no longer count it as an ancestor
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(child0it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(grandchildit->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(grandchildit->GetModFeesWithAncestors(), 6500);
+
+    // The grandchild goes: its ancestor no longer counts it as a descendant
+    testPool.remove(txGrandChild, removed, false);
+    BOOST_CHECK_EQUAL(child0it->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(child0it->GetModFeesWithDescendants(), 2500);
+
+    // Mining score puts the better paying transaction first
+    BOOST_CHECK(testPool.mapTx.get<mining_score>().begin()->GetTx().GetHash() == txChild[1].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolChainLimitTest)
+{
+    // A chain of unconfirmed transactions is accepted up to the ancestor and
+    // descendant limits, and the next transaction in the chain is refused
+    FundedKey funded(1, 10 * COIN);
+    CTransaction txPrev = funded.txFund;
+
+    LOCK(cs_main);
+
+    CTxMemPool testPool(CFeeRate(0));
+    for (unsigned int i = 0; i <= DEFAULT_ANCESTOR_LIMIT; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = txPrev.GetHash();
+        tx.vin[0].prevout.n = 0;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = funded.scriptPubKey;
+        tx.vout[0].nValue = txPrev.vout[0].nValue - COIN / 100;
+        BOOST_CHECK(SignSignature(funded.keystore, txPrev, tx, 0));
+        txPrev = CTransaction(tx);
+
+        CValidationState state;
+        bool fAccepted = AcceptToMemoryPool(testPool, state, txPrev, false, NULL);
+        if (i < DEFAULT_ANCESTOR_LIMIT) {
+            BOOST_CHECK(fAccepted);
+        } else {
+            BOOST_CHECK(!fAccepted);
+            BOOST_CHECK_EQUAL(state.GetRejectReason(), "too-long-mempool-chain");
+        }
+    }
+    BOOST_CHECK_EQUAL(testPool.size(), DEFAULT_ANCESTOR_LIMIT);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // Three independent transactions paying different fee rates
+    CTxMemPool testPool(CFeeRate(1000));
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = uint256(i + 1);
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+    testPool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 10000, nNow, 0.0, 1, 1));
+    testPool.addUnchecked(tx[1].GetHash(), CTxMemPoolEntry(tx[1], 5000, nNow + 1, 0.0, 1, 1));
+    testPool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], 20000, nNow + 2, 0.0, 1, 1));
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Trimming to a bit less than the current usage evicts the cheapest transaction
+    // and raises the minimum fee above its fee rate
+    testPool.TrimToSize(testPool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+    BOOST_CHECK(!testPool.exists(tx[1].GetHash()));
+    BOOST_CHECK_EQUAL(testPool.GetEvictedTotal(), 1);
+    CFeeRate minFee = testPool.GetMinFee(1);
+    BOOST_CHECK(minFee > CFeeRate(5000, ::GetSerializeSize(tx[1], SER_NETWORK, PROTOCOL_VERSION)));
+
+    // The minimum fee only decays after a block, then halves every half-life
+    SetMockTime(nNow + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(testPool.GetMinFee(1) == minFee);
+    std::list<CTransaction> conflicts;
+    testPool.removeForBlock(std::vector<CTransaction>(), 1, conflicts);
+    SetMockTime(nNow + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1).GetFeePerK(), std::max(minFee.GetFeePerK() / 2, (CAmount)1000));
+
+    // Expiry removes what entered the pool before the cutoff
+    BOOST_CHECK_EQUAL(testPool.Expire(nNow + 1), 1);
+    BOOST_CHECK(!testPool.exists(tx[0].GetHash()));
+    BOOST_CHECK(testPool.exists(tx[2].GetHash()));
+    BOOST_CHECK_EQUAL(testPool.GetExpiredTotal(), 1);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBlockAssemblyTest)
+{
+    // A low fee parent with a high fee child is selected as a package ahead of
+    // a transaction paying a fee rate between the two
+    const int nPoolSize = 10000;
+    FundedKey funded(nPoolSize + 2, 11 * COIN, CScript() << OP_11 << OP_EQUAL);
+
+    CMutableTransaction txParent, txChild, txOther, txOrphan;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vin[0].prevout.hash = funded.txFund.GetHash();
+    txParent.vin[0].prevout.n = 0;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    txChild = txParent;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txOther = txParent;
+    txOther.vin[0].prevout.n = 1;
+    // Spends an output that exists neither in the chain nor in the pool
+    txOrphan = txParent;
+    txOrphan.vin[0].prevout.hash = uint256(2);
+
+    LOCK(cs_main);
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 20000, 0, 0.0, 1, 1));
+    testPool.addUnchecked(txOrphan.GetHash(), CTxMemPoolEntry(txOrphan, 500000, 0, 0.0, 1, 1));
+
+    mapArgs["-blockprioritysize"] = "0";
+    {
+        LOCK(testPool.cs);
+        CBlockTemplate blocktemplate;
+        BlockAssembler assembler(testPool, &blocktemplate, 2);
+        assembler.AddMempoolTransactions();
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 3);
+        BOOST_CHECK(blocktemplate.block.vtx[0].GetHash() == txParent.GetHash());
+        BOOST_CHECK(blocktemplate.block.vtx[1].GetHash() == txChild.GetHash());
+        BOOST_CHECK(blocktemplate.block.vtx[2].GetHash() == txOther.GetHash());
+        BOOST_CHECK_EQUAL(assembler.GetFees(), 121000);
+    }
+
+    // A pool larger than a block fills the block without going over it, and the
+    // priority space still starts with the highest priority transaction in the pool
+    CTxMemPool pool(CFeeRate(0));
+    uint256 hashHighPriority;
+    for (int i = 0; i < nPoolSize; i++) {
+        CMutableTransaction tx = txParent;
+        tx.vin[0].prevout.n = i + 2;
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(200, 0x11) << OP_DROP << OP_11;
+        double dPriority = (i == nPoolSize - 1) ? 1e16 : (double)i;
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000 + (i * 7919) % 50000, 0, dPriority, 1, 1));
+        hashHighPriority = tx.GetHash();
+    }
+    mapArgs["-blockprioritysize"] = "1000";
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        BlockAssembler assembler(pool, &blocktemplate, 2);
+        assembler.AddMempoolTransactions();
+        BOOST_CHECK(assembler.GetBlockSize() < DEFAULT_BLOCK_MAX_SIZE);
+        BOOST_CHECK(assembler.GetBlockTx() > 0);
+        BOOST_CHECK(assembler.GetBlockTx() < pool.size());
+        BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), assembler.GetBlockTx());
+        BOOST_CHECK(blocktemplate.block.vtx[0].GetHash() == hashHighPriority);
+    }
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistTest)
+{
+    // Transactions are accepted again on reload with the time they first entered
+    // the pool, and prioritisation deltas survive both for transactions that were
+    // in the pool and for ones that were only prioritised
+    FundedKey funded(1, 10 * COIN);
+
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout.hash = funded.txFund.GetHash();
+    txSpend.vin[0].prevout.n = 0;
+    txSpend.vout.resize(1);
+    txSpend.vout[0].scriptPubKey = funded.scriptPubKey;
+    txSpend.vout[0].nValue = 10 * COIN - COIN / 100;
+    BOOST_CHECK(SignSignature(funded.keystore, funded.txFund, txSpend, 0));
+    uint256 hashSpend = CTransaction(txSpend).GetHash();
+
+    LOCK(cs_main);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = uint256(3);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    uint256 hashOther = uint256(4);
+
+    int64_t nEntryTime = GetTime() - 60 * 60;
+    mempool.clear();
+    mempool.addUnchecked(hashSpend, CTxMemPoolEntry(txSpend, COIN / 100, nEntryTime, 0.0, chainActive.Height(), 1));
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, GetTime(), 0.0, 1, 1));
+    mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), 1.5, 2000);
+    mempool.PrioritiseTransaction(hashOther, hashOther.ToString(), 0.0, 3000);
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(GetDataDir() / "mempool.dat"));
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+    BOOST_CHECK(LoadMempool());
+
+    // The funded spend is back with its original entry time; the other
+    // transaction spends a missing input so it is not re-accepted
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+    BOOST_CHECK(mempool.exists(hashSpend));
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter spendit = mempool.mapTx.find(hashSpend);
+        BOOST_CHECK(spendit != mempool.mapTx.end() && spendit->GetTime() == nEntryTime);
+    }
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(tx.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1.5);
+    BOOST_CHECK_EQUAL(nFeeDelta, 2000);
+    dPriorityDelta = 0;
+    nFeeDelta = 0;
+    mempool.ApplyDeltas(hashOther, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 3000);
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSharedTxTest)
+{
+    // Entries built from a shared transaction keep a reference to it
+    // instead of their own copy
+    const int nFloodSize = 20000;
+    std::vector<CTransactionRef> vtx;
+    vtx.reserve(nFloodSize);
+    for (int i = 0; i < nFloodSize; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(4);
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            tx.vin[j].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+            tx.vin[j].prevout.hash = uint256(i + 1);
+            tx.vin[j].prevout.n = j;
+        }
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1] = tx.vout[0];
+        vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+
+    CTxMemPool sharedPool(CFeeRate(0));
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        sharedPool.addUnchecked(vtx[i]->GetHash(), CTxMemPoolEntry(vtx[i], 1000, 0, 0.0, 1, 1));
+
+    CTxMemPool copyPool(CFeeRate(0));
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        copyPool.addUnchecked(vtx[i]->GetHash(), CTxMemPoolEntry(CTransaction(*vtx[i]), 1000, 0, 0.0, 1, 1));
+
+    BOOST_CHECK(sharedPool.get(vtx[0]->GetHash()).get() == vtx[0].get());
+    BOOST_CHECK(copyPool.get(vtx[0]->GetHash()).get() != vtx[0].get());
+    BOOST_CHECK(!sharedPool.get(uint256(0)));
+    BOOST_CHECK_EQUAL(vtx[0].use_count(), 2);
+    BOOST_CHECK_EQUAL(sharedPool.DynamicMemoryUsage(), copyPool.DynamicMemoryUsage());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexStressTest)
+{
+    // 5000 entries in chains of 25: every index sees each entry once, package
+    // totals span whole chains, and removing them root first as blocks would
+    // empties the pool
+    const int nChains = 200;
+    const int nChainLength = 25;
+    std::vector<CTransaction> vtx;
+    vtx.reserve(nChains * nChainLength);
+    for (int i = 0; i < nChains; i++) {
+        uint256 hashPrev = uint256(i + 1);
+        for (int j = 0; j < nChainLength; j++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << OP_11;
+            tx.vin[0].prevout.hash = hashPrev;
+            tx.vin[0].prevout.n = 0;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = 11000LL;
+            vtx.push_back(tx);
+            hashPrev = tx.GetHash();
+        }
+    }
+
+    CTxMemPool testPool(CFeeRate(0));
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        testPool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], 1000 + (i * 7919) % 50000, i, 0.0, 1, 1));
+    BOOST_CHECK_EQUAL(testPool.size(), vtx.size());
+
+    {
+        LOCK(testPool.cs);
+        uint64_t nCount = 0;
+        for (CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator it = testPool.mapTx.get<mining_score>().begin(); it != testPool.mapTx.get<mining_score>().end(); ++it)
+            nCount++;
+        for (CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = testPool.mapTx.get<ancestor_score>().begin(); it != testPool.mapTx.get<ancestor_score>().end(); ++it)
+            nCount++;
+        for (CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator it = testPool.mapTx.get<descendant_score>().begin(); it != testPool.mapTx.get<descendant_score>().end(); ++it)
+            nCount++;
+        for (CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator it = testPool.mapTx.get<entry_time>().begin(); it != testPool.mapTx.get<entry_time>().end(); ++it)
+            nCount++;
+        BOOST_CHECK_EQUAL(nCount, 4 * vtx.size());
+
+        CTxMemPool::txiter rootit = testPool.mapTx.find(vtx[0].GetHash());
+        CTxMemPool::txiter tipit = testPool.mapTx.find(vtx[nChainLength - 1].GetHash());
+        BOOST_CHECK_EQUAL(rootit->GetCountWithDescendants(), nChainLength);
+        BOOST_CHECK_EQUAL(tipit->GetCountWithAncestors(), nChainLength);
+        BOOST_CHECK(testPool.mapTx.get<entry_time>().begin()->GetTx().GetHash() == vtx[0].GetHash());
+    }
+
+    std::list<CTransaction> removed;
+    for (int j = 0; j < nChainLength; j++) {
+        for (int i = 0; i < nChains; i++)
+            testPool.remove(vtx[i * nChainLength + j], removed, false);
+    }
+    BOOST_CHECK_EQUAL(removed.size(), vtx.size());
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBatchAcceptTest)
+{
+    // Results come back in batch order whatever order the batch is processed in
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vin[0].prevout.hash = uint256(1);
+    txParent.vin[0].prevout.n = 0;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x01) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txParent.vout[0].nValue = 10 * COIN;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = txParent.vout[0].scriptPubKey;
+    txChild.vout[0].nValue = 9 * COIN;
+
+    CMutableTransaction txEmpty;
+    txEmpty.vout.resize(1);
+    txEmpty.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txEmpty.vout[0].nValue = COIN;
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(CTransaction(txChild)));
+    vtx.push_back(MakeTransactionRef(CTransaction(txEmpty)));
+    vtx.push_back(MakeTransactionRef(CTransaction(txParent)));
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    AcceptToMemoryPoolBatch(testPool, vtx, vState, vAccepted);
+
+    BOOST_CHECK_EQUAL(vState.size(), vtx.size());
+    BOOST_CHECK_EQUAL(vAccepted.size(), vtx.size());
+    // The parent spends an unknown output, so neither it nor its child gets in
+    BOOST_CHECK(!vAccepted[0] && vState[0].IsValid());
+    BOOST_CHECK(!vAccepted[2] && vState[2].IsValid());
+    // A transaction without inputs fails the context-free checks
+    BOOST_CHECK(!vAccepted[1] && vState[1].IsInvalid());
+    BOOST_CHECK_EQUAL(vState[1].GetRejectReason(), "bad-txns-vin-empty");
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBatchAcceptFundedTest)
+{
+    // A funded parent and its child are both accepted when the child comes first
+    FundedKey funded(1, 10 * COIN);
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout.hash = funded.txFund.GetHash();
+    txParent.vin[0].prevout.n = 0;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = funded.scriptPubKey;
+    txParent.vout[0].nValue = 9 * COIN;
+    BOOST_CHECK(SignSignature(funded.keystore, funded.txFund, txParent, 0));
+    CTransaction txParentFinal(txParent);
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout.hash = txParentFinal.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = funded.scriptPubKey;
+    txChild.vout[0].nValue = 8 * COIN;
+    BOOST_CHECK(SignSignature(funded.keystore, txParentFinal, txChild, 0));
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(CTransaction(txChild)));
+    vtx.push_back(MakeTransactionRef(txParentFinal));
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted;
+    AcceptToMemoryPoolBatch(testPool, vtx, vState, vAccepted);
+
+    BOOST_CHECK(vAccepted[0]);
+    BOOST_CHECK(vAccepted[1]);
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+    BOOST_CHECK(testPool.exists(txParentFinal.GetHash()));
+    BOOST_CHECK(testPool.exists(vtx[0]->GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolParallelScriptCheckTest)
+{
+    // A many-input transaction is accepted or rejected the same way
+    // whether its scripts are checked serially or on the check queue
+    const unsigned int nInputs = 40;
+    FundedKey funded(nInputs, COIN);
+
+    LOCK(cs_main);
+
+    std::vector<CMutableTransaction> vSpend(2);
+    for (unsigned int n = 0; n < vSpend.size(); n++) {
+        vSpend[n].vin.resize(nInputs);
+        for (unsigned int i = 0; i < nInputs; i++) {
+            vSpend[n].vin[i].prevout.hash = funded.txFund.GetHash();
+            vSpend[n].vin[i].prevout.n = i;
+        }
+        vSpend[n].vout.resize(1);
+        vSpend[n].vout[0].scriptPubKey = funded.scriptPubKey;
+        vSpend[n].vout[0].nValue = (nInputs - 1 - n) * COIN;
+        for (unsigned int i = 0; i < nInputs; i++)
+            BOOST_CHECK(SignSignature(funded.keystore, funded.txFund, vSpend[n], i));
+    }
+
+    int nThreads = nScriptCheckThreads;
+    BOOST_CHECK(nThreads > 0);
+
+    CValidationState state;
+    CTxMemPool serialPool(CFeeRate(0));
+    nScriptCheckThreads = 0;
+    BOOST_CHECK(AcceptToMemoryPool(serialPool, state, CTransaction(vSpend[0]), false, NULL));
+
+    CTxMemPool parallelPool(CFeeRate(0));
+    nScriptCheckThreads = nThreads;
+    BOOST_CHECK(AcceptToMemoryPool(parallelPool, state, CTransaction(vSpend[1]), false, NULL));
+    BOOST_CHECK_EQUAL(serialPool.size(), 1);
+    BOOST_CHECK_EQUAL(parallelPool.size(), 1);
+
+    // Break the signature of the last input
+    CMutableTransaction txBad = vSpend[1];
+    txBad.vin[nInputs - 1] = vSpend[0].vin[nInputs - 1];
+    CValidationState stateSerial, stateParallel;
+    CTxMemPool badPool(CFeeRate(0));
+    nScriptCheckThreads = 0;
+    BOOST_CHECK(!AcceptToMemoryPool(badPool, stateSerial, CTransaction(txBad), false, NULL));
+    nScriptCheckThreads = nThreads;
+    BOOST_CHECK(!AcceptToMemoryPool(badPool, stateParallel, CTransaction(txBad), false, NULL));
+    int nDoSSerial = 0, nDoSParallel = 0;
+    BOOST_CHECK(stateSerial.IsInvalid(nDoSSerial));
+    BOOST_CHECK(stateParallel.IsInvalid(nDoSParallel));
+    BOOST_CHECK_EQUAL(nDoSParallel, nDoSSerial);
+    BOOST_CHECK_EQUAL(stateParallel.GetRejectReason(), stateSerial.GetRejectReason());
+    BOOST_CHECK_EQUAL(stateParallel.GetRejectCode(), stateSerial.GetRejectCode());
+    BOOST_CHECK_EQUAL(badPool.size(), 0);
+
+    // Input 2 also breaks a standard-only flag with a non-minimal push: the
+    // queue meets the last input first, but like a serial check it reports
+    // input 2 as non-standard rather than the mandatory failure
+    CMutableTransaction txMixed = txBad;
+    CScript::const_iterator pc = txMixed.vin[2].scriptSig.begin();
+    opcodetype opcode;
+    std::vector<unsigned char> vchSig, vchPubKey;
+    BOOST_CHECK(txMixed.vin[2].scriptSig.GetOp(pc, opcode, vchSig));
+    BOOST_CHECK(txMixed.vin[2].scriptSig.GetOp(pc, opcode, vchPubKey));
+    CScript scriptSig;
+    scriptSig.push_back(OP_PUSHDATA1);
+    scriptSig.push_back((unsigned char)vchSig.size());
+    scriptSig.insert(scriptSig.end(), vchSig.begin(), vchSig.end());
+    scriptSig << vchPubKey;
+    txMixed.vin[2].scriptSig = scriptSig;
+    CValidationState stateMixedSerial, stateMixedParallel;
+    nScriptCheckThreads = 0;
+    BOOST_CHECK(!AcceptToMemoryPool(badPool, stateMixedSerial, CTransaction(txMixed), false, NULL));
+    nScriptCheckThreads = nThreads;
+    BOOST_CHECK(!AcceptToMemoryPool(badPool, stateMixedParallel, CTransaction(txMixed), false, NULL));
+    BOOST_CHECK(stateMixedSerial.IsInvalid(nDoSSerial));
+    BOOST_CHECK(stateMixedParallel.IsInvalid(nDoSParallel));
+    BOOST_CHECK_EQUAL(nDoSSerial, 0);
+    BOOST_CHECK_EQUAL(nDoSParallel, 0);
+    BOOST_CHECK_EQUAL(stateMixedParallel.GetRejectReason(), stateMixedSerial.GetRejectReason());
+    BOOST_CHECK_EQUAL(stateMixedParallel.GetRejectCode(), REJECT_NONSTANDARD);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
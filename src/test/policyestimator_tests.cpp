@@ -0,0 +1,136 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(policyestimator_tests)
+
+/**
+ * Replay nBlocks blocks into the pool. Every block adds 5 transactions at
+ * each of 10 fee levels, and the block at height h confirms all waiting
+ * transactions of the (h % 10) + 1 highest levels, so higher fees confirm
+ * sooner.
+ */
+static void ReplayBlocks(CTxMemPool& pool, int& nHeight, int nBlocks, const std::vector<CAmount>& vFees)
+{
+    std::vector<uint256> vHashes[10];
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_TRUE;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = COIN;
+
+    for (int n = 0; n < nBlocks; n++) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 5; k++) {
+                tx.vin[0].prevout.hash = uint256(nHeight + 1);
+                tx.vin[0].prevout.n = 10000 * j + k;
+                CTransactionRef ptx = MakeTransactionRef(CTransaction(tx));
+                pool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, vFees[j], GetTime(), 0.0, nHeight, 1));
+                vHashes[j].push_back(ptx->GetHash());
+            }
+        }
+        std::vector<CTransaction> block;
+        for (int h = 0; h <= nHeight % 10; h++) {
+            for (const uint256& hash : vHashes[9 - h])
+                block.push_back(*pool.get(hash));
+            vHashes[9 - h].clear();
+        }
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(block, ++nHeight, conflicts);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::vector<CAmount> vFees;
+    for (int j = 0; j < 10; j++)
+        vFees.push_back(10000 * (j + 1));
+
+    BOOST_CHECK(pool.estimateFee(1) == CFeeRate(0));
+    int nFoundAt = -1;
+    BOOST_CHECK(pool.estimateSmartFee(1, &nFoundAt) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(nFoundAt, 0);
+
+    int nHeight = 0;
+    ReplayBlocks(pool, nHeight, 200, vFees);
+
+    // The highest fee level always confirms in the next block, and the
+    // estimates fall as the target grows
+    std::vector<CFeeRate> vEstimates;
+    for (int i = 1; i <= 25; i++)
+        vEstimates.push_back(pool.estimateFee(i));
+    BOOST_CHECK(vEstimates[0] > CFeeRate(0));
+    for (int i = 1; i < 10; i++)
+        BOOST_CHECK(vEstimates[i] <= vEstimates[i - 1]);
+    BOOST_CHECK(vEstimates[9] < vEstimates[0]);
+    BOOST_CHECK(pool.estimateFee(0) == CFeeRate(0));
+    BOOST_CHECK(pool.estimateFee(26) == CFeeRate(0));
+    BOOST_CHECK(pool.estimateSmartFee(1, &nFoundAt) == vEstimates[0]);
+    BOOST_CHECK_EQUAL(nFoundAt, 1);
+    BOOST_CHECK(pool.estimateSmartFee(100, &nFoundAt) == vEstimates[24]);
+    BOOST_CHECK_EQUAL(nFoundAt, 25);
+
+    // Estimates survive a write and read through the fee_estimates file format
+    boost::filesystem::path path = GetTempPath() / strprintf("test_fee_estimates_%lu.dat", (unsigned long)GetTime());
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(pool.WriteFeeEstimates(fileout));
+    }
+    CTxMemPool loadedPool(CFeeRate(1000));
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(loadedPool.ReadFeeEstimates(filein));
+    }
+    boost::filesystem::remove(path);
+    for (int i = 1; i <= 25; i++)
+        BOOST_CHECK(loadedPool.estimateFee(i) == vEstimates[i - 1]);
+
+    // Once the top fee levels stop confirming the short target estimates rise
+    std::vector<CAmount> vHighFees;
+    for (int j = 0; j < 10; j++)
+        vHighFees.push_back(vFees[j] * 2);
+    ReplayBlocks(pool, nHeight, 200, vHighFees);
+    BOOST_CHECK(pool.estimateFee(1) > vEstimates[0]);
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyOldFormat)
+{
+    // Files in the per-block sample format are ignored
+    boost::filesystem::path path = GetTempPath() / strprintf("test_fee_estimates_old_%lu.dat", (unsigned long)GetTime());
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        fileout << 120000 << CLIENT_VERSION << 100 << (size_t)25;
+    }
+    CTxMemPool pool(CFeeRate(1000));
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!pool.ReadFeeEstimates(filein));
+    }
+    boost::filesystem::remove(path);
+    BOOST_CHECK(pool.estimateFee(1) == CFeeRate(0));
+
+    // Files that require a newer client are refused
+    path = GetTempPath() / strprintf("test_fee_estimates_new_%lu.dat", (unsigned long)GetTime());
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        fileout << (CLIENT_VERSION + 1) << (CLIENT_VERSION + 1);
+    }
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!pool.ReadFeeEstimates(filein));
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
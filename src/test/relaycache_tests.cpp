@@ -0,0 +1,94 @@
+// Copyright (c) 2021 The VKC Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "primitives/transaction.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CRelayCache::CPayloadRef MakePayload(const CTransaction& tx)
+{
+    std::shared_ptr<CDataStream> ss = std::make_shared<CDataStream>(SER_NETWORK, PROTOCOL_VERSION);
+    *ss << tx;
+    return ss;
+}
+
+static CTransaction MakeTx(int n, unsigned int nScriptSize)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = uint256(n + 1);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(nScriptSize, 0x01);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(relaycache_tests)
+
+BOOST_AUTO_TEST_CASE(relaycache_shared_payload)
+{
+    CRelayCache cache(1000000, 15 * 60);
+    CTransaction tx = MakeTx(0, 100);
+    CInv inv(MSG_TX, tx.GetHash());
+    CRelayCache::CPayloadRef payload = MakePayload(tx);
+
+    BOOST_CHECK(!cache.Find(inv));
+    cache.Insert(inv, payload, 1000);
+    BOOST_CHECK(cache.Exists(inv));
+    BOOST_CHECK_EQUAL(cache.GetBytes(), payload->size());
+
+    // Every lookup hands out the same buffer
+    for (int i = 0; i < 8; i++)
+        BOOST_CHECK(cache.Find(inv).get() == payload.get());
+    BOOST_CHECK_EQUAL(cache.GetHits(), 8);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1);
+
+    // A second insert keeps the original payload
+    cache.Insert(inv, MakePayload(tx), 1000);
+    BOOST_CHECK(cache.Find(inv).get() == payload.get());
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), payload->size());
+
+    // Type is part of the key
+    BOOST_CHECK(!cache.Exists(CInv(MSG_TXLOCK_REQUEST, tx.GetHash())));
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_expiry_and_budget)
+{
+    CRelayCache cache(1000000, 15 * 60);
+    CTransaction tx0 = MakeTx(0, 100);
+    CTransaction tx1 = MakeTx(1, 100);
+    cache.Insert(CInv(MSG_TX, tx0.GetHash()), MakePayload(tx0), 1000);
+    cache.Insert(CInv(MSG_TX, tx1.GetHash()), MakePayload(tx1), 1000 + 15 * 60 + 1);
+    BOOST_CHECK(!cache.Exists(CInv(MSG_TX, tx0.GetHash())));
+    BOOST_CHECK(cache.Exists(CInv(MSG_TX, tx1.GetHash())));
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+
+    // Oldest entries go first when the byte budget is exceeded
+    size_t nPayloadSize = MakePayload(MakeTx(0, 1000))->size();
+    CRelayCache budget(10 * nPayloadSize, 15 * 60);
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 25; i++) {
+        vtx.push_back(MakeTx(i, 1000));
+        budget.Insert(CInv(MSG_TX, vtx.back().GetHash()), MakePayload(vtx.back()), 1000);
+        BOOST_CHECK(budget.GetBytes() <= 10 * nPayloadSize);
+    }
+    BOOST_CHECK_EQUAL(budget.Size(), 10);
+    BOOST_CHECK(!budget.Exists(CInv(MSG_TX, vtx[14].GetHash())));
+    BOOST_CHECK(budget.Exists(CInv(MSG_TX, vtx[15].GetHash())));
+
+    budget.SetMaxBytes(5 * nPayloadSize);
+    BOOST_CHECK_EQUAL(budget.Size(), 5);
+    BOOST_CHECK(budget.Exists(CInv(MSG_TX, vtx[24].GetHash())));
+
+    budget.Clear();
+    BOOST_CHECK_EQUAL(budget.Size(), 0);
+    BOOST_CHECK_EQUAL(budget.GetBytes(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -238,6 +238,46 @@ BOOST_AUTO_TEST_CASE(is)
     BOOST_CHECK(!not_p2sh.IsPayToScriptHash());
 }
 
+BOOST_AUTO_TEST_CASE(ismine_index)
+{
+    CBasicKeyStore keystore;
+    CKey key, other;
+    key.MakeNewKey(true);
+    other.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CScript p2pkh = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript p2pk = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    BOOST_CHECK_EQUAL(IsMine(keystore, p2pkh), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(IsMine(keystore, p2pk), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(IsMine(keystore, GetScriptForDestination(other.GetPubKey().GetID())), ISMINE_NO);
+
+    // A non-canonical push of our key hash isn't indexed and still goes through Solver
+    CScript pushdata1;
+    pushdata1 << OP_DUP << OP_HASH160;
+    pushdata1.insert(pushdata1.end(), OP_PUSHDATA1);
+    pushdata1.insert(pushdata1.end(), 20);
+    std::vector<unsigned char> vchHash = ToByteVector(key.GetPubKey().GetID());
+    pushdata1.insert(pushdata1.end(), vchHash.begin(), vchHash.end());
+    pushdata1 << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK_EQUAL(IsMine(keystore, pushdata1), ISMINE_SPENDABLE);
+
+    // Removing a watch-only entry leaves scripts that are ours for another reason
+    keystore.AddWatchOnly(p2pkh);
+    keystore.RemoveWatchOnly(p2pkh);
+    BOOST_CHECK_EQUAL(IsMine(keystore, p2pkh), ISMINE_SPENDABLE);
+
+    CScript watched = GetScriptForDestination(other.GetPubKey().GetID());
+    keystore.AddWatchOnly(watched);
+    BOOST_CHECK_EQUAL(IsMine(keystore, watched), ISMINE_WATCH_ONLY);
+    keystore.RemoveWatchOnly(watched);
+    BOOST_CHECK_EQUAL(IsMine(keystore, watched), ISMINE_NO);
+
+    CScript redeem = GetScriptForDestination(key.GetPubKey().GetID());
+    keystore.AddCScript(redeem);
+    BOOST_CHECK_EQUAL(IsMine(keystore, GetScriptForDestination(CScriptID(redeem))), ISMINE_SPENDABLE);
+}
+
 BOOST_AUTO_TEST_CASE(switchover)
 {
     // Test switch over code
@@ -266,8 +266,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
+            // picking 50 from 100 coins depends on the shuffle, which orders
+            // the equal values the subset search walks through
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
@@ -305,4 +305,32 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_many_small_coins)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // staking-style wallet: lots of small coins of a few distinct values
+    empty_wallet();
+    for (int i = 0; i < 20000; i++)
+        add_coin((1 + i % 7) * CENT);
+
+    // an exact match exists and is found well within the search budget
+    BOOST_CHECK(wallet.SelectCoinsMinConf(123 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 123 * CENT);
+    BOOST_CHECK(setCoinsRet.size() <= 123U / 7 + 1);
+
+    // no exact match: the smallest total above the target still comes out of the search
+    empty_wallet();
+    for (int i = 0; i < 20000; i++)
+        add_coin(2 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(101 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 102 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 51U);
+
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,26 +9,40 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
-#include <boost/circular_buffer.hpp>
+#include <limits>
+#include <math.h>
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+CTxMemPoolEntry::CTxMemPoolEntry() : tx(MakeTransactionRef()), nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), nFeeDelta(0), nSigOps(0)
 {
     nHeight = MEMPOOL_HEIGHT;
+    nCountWithDescendants = nCountWithAncestors = 1;
+    nSizeWithDescendants = nSizeWithAncestors = 0;
+    nModFeesWithDescendants = nModFeesWithAncestors = 0;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight, unsigned int _nSigOps) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0), nSigOps(_nSigOps)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
 
-    nModSize = tx.CalculateModifiedSize(nTxSize);
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithDescendants = nCountWithAncestors = 1;
+    nSizeWithDescendants = nSizeWithAncestors = nTxSize;
+    nModFeesWithDescendants = nModFeesWithAncestors = nFee;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight, unsigned int _nSigOps) : CTxMemPoolEntry(MakeTransactionRef(_tx), _nFee, _nTime, _dPriority, _nHeight, _nSigOps)
+{
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -39,166 +53,386 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    CAmount nValueIn = tx.GetValueOut() + nFee;
+    CAmount nValueIn = tx->GetValueOut() + nFee;
     double deltaPriority = ((double)(currentHeight - nHeight) * nValueIn) / nModSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithDescendants += nModifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += nModifyFee;
+    nCountWithDescendants += nModifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithAncestors += nModifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+SaltedTxidHasher::SaltedTxidHasher() : salt(GetRandHash()) {}
+
 /**
- * Keep track of fee/priority for transactions confirmed within N blocks
+ * Confirmation statistics for transactions grouped into buckets by fee rate
+ * (or priority). Every bucket keeps exponentially decaying counts of how many
+ * of its transactions confirmed within 1, 2, ... nMaxConfirms blocks, and how
+ * many are still unconfirmed, by the height at which they entered the pool.
  */
-class CBlockAverage
+class TxConfirmStats
 {
 private:
-    boost::circular_buffer<CFeeRate> feeSamples;
-    boost::circular_buffer<double> prioritySamples;
+    //! Upper bound of each bucket, the last bucket catches everything above
+    std::vector<double> buckets;
+    std::map<double, unsigned int> bucketMap;
 
-    template <typename T>
-    std::vector<T> buf2vec(boost::circular_buffer<T> buf) const
-    {
-        std::vector<T> vec(buf.begin(), buf.end());
-        return vec;
-    }
+    //! Per bucket: decayed count of confirmed transactions and the sum of their values
+    std::vector<double> txCtAvg;
+    std::vector<double> avg;
+    //! confAvg[Y][X]: decayed count of transactions in bucket X confirmed within Y + 1 blocks
+    std::vector<std::vector<double> > confAvg;
 
-public:
-    CBlockAverage() : feeSamples(100), prioritySamples(100) {}
+    //! Confirmations seen in the block being processed, folded into the averages afterwards
+    std::vector<int> curBlockTxCt;
+    std::vector<double> curBlockVal;
+    std::vector<std::vector<int> > curBlockConf;
+
+    //! unconfTxs[nHeight % nMaxConfirms][X]: transactions from bucket X that entered at nHeight and are unconfirmed
+    std::vector<std::vector<int> > unconfTxs;
+    //! Unconfirmed transactions that entered more than nMaxConfirms blocks ago
+    std::vector<int> oldUnconfTxs;
+
+    double decay;
+    std::string dataTypeString;
 
-    void RecordFee(const CFeeRate& feeRate)
+public:
+    void Initialize(const std::vector<double>& defaultBuckets, unsigned int nMaxConfirms, double _decay, const std::string& _dataTypeString)
     {
-        feeSamples.push_back(feeRate);
+        decay = _decay;
+        dataTypeString = _dataTypeString;
+        buckets = defaultBuckets;
+        bucketMap.clear();
+        for (unsigned int i = 0; i < buckets.size(); i++)
+            bucketMap[buckets[i]] = i;
+        txCtAvg.assign(buckets.size(), 0);
+        avg.assign(buckets.size(), 0);
+        confAvg.assign(nMaxConfirms, std::vector<double>(buckets.size(), 0));
+        curBlockTxCt.assign(buckets.size(), 0);
+        curBlockVal.assign(buckets.size(), 0);
+        curBlockConf.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+        unconfTxs.assign(nMaxConfirms, std::vector<int>(buckets.size(), 0));
+        oldUnconfTxs.assign(buckets.size(), 0);
     }
 
-    void RecordPriority(double priority)
+    unsigned int GetMaxConfirms() const { return confAvg.size(); }
+
+    /** Start a new block: transactions that entered nMaxConfirms blocks ago become old */
+    void ClearCurrent(unsigned int nBlockHeight)
     {
-        prioritySamples.push_back(priority);
+        std::vector<int>& unconf = unconfTxs[nBlockHeight % unconfTxs.size()];
+        for (unsigned int j = 0; j < buckets.size(); j++) {
+            oldUnconfTxs[j] += unconf[j];
+            unconf[j] = 0;
+            for (unsigned int i = 0; i < curBlockConf.size(); i++)
+                curBlockConf[i][j] = 0;
+            curBlockTxCt[j] = 0;
+            curBlockVal[j] = 0;
+        }
     }
 
-    size_t FeeSamples() const { return feeSamples.size(); }
-    size_t GetFeeSamples(std::vector<CFeeRate>& insertInto) const
+    /** A transaction with value val confirmed after nBlocksToConfirm blocks */
+    void Record(int nBlocksToConfirm, double val)
     {
-        for (const CFeeRate& f : feeSamples)
-            insertInto.push_back(f);
-        return feeSamples.size();
+        if (nBlocksToConfirm < 1)
+            return;
+        unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+        for (size_t i = nBlocksToConfirm; i <= curBlockConf.size(); i++)
+            curBlockConf[i - 1][bucketindex]++;
+        curBlockTxCt[bucketindex]++;
+        curBlockVal[bucketindex] += val;
     }
-    size_t PrioritySamples() const { return prioritySamples.size(); }
-    size_t GetPrioritySamples(std::vector<double>& insertInto) const
+
+    /** Fold the current block into the moving averages */
+    void UpdateMovingAverages()
     {
-        for (double d : prioritySamples)
-            insertInto.push_back(d);
-        return prioritySamples.size();
+        for (unsigned int j = 0; j < buckets.size(); j++) {
+            for (unsigned int i = 0; i < confAvg.size(); i++)
+                confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+            avg[j] = avg[j] * decay + curBlockVal[j];
+            txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+        }
     }
 
-    /**
-     * Used as belt-and-suspenders check when reading to detect
-     * file corruption
-     */
-    static bool AreSane(const CFeeRate fee, const CFeeRate& minRelayFee)
+    /** A transaction with value val entered the pool at nBlockHeight; returns its bucket */
+    unsigned int NewTx(unsigned int nBlockHeight, double val)
     {
-        if (fee < CFeeRate(0))
-            return false;
-        if (fee.GetFeePerK() > minRelayFee.GetFeePerK() * 10000)
-            return false;
-        return true;
+        unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+        unconfTxs[nBlockHeight % unconfTxs.size()][bucketindex]++;
+        return bucketindex;
     }
-    static bool AreSane(const std::vector<CFeeRate>& vecFee, const CFeeRate& minRelayFee)
+
+    /** A transaction that entered at nEntryHeight left the pool, confirmed or not */
+    void RemoveTx(unsigned int nEntryHeight, unsigned int nBestSeenHeight, unsigned int bucketindex)
     {
-        for (CFeeRate fee : vecFee) {
-            if (!AreSane(fee, minRelayFee))
-                return false;
+        int blocksAgo = nBestSeenHeight - nEntryHeight;
+        if (nBestSeenHeight == 0)
+            blocksAgo = 0;
+        if (blocksAgo < 0) {
+            LogPrint("estimatefee", "Blockpolicy error, blocks ago is negative for mempool tx\n");
+            return;
+        }
+        if (blocksAgo >= (int)unconfTxs.size()) {
+            if (oldUnconfTxs[bucketindex] > 0)
+                oldUnconfTxs[bucketindex]--;
+        } else {
+            std::vector<int>& unconf = unconfTxs[nEntryHeight % unconfTxs.size()];
+            if (unconf[bucketindex] > 0)
+                unconf[bucketindex]--;
         }
-        return true;
-    }
-    static bool AreSane(const double priority)
-    {
-        return priority >= 0;
     }
-    static bool AreSane(const std::vector<double> vecPriority)
+
+    /**
+     * Walk the buckets from the highest value down, grouping neighbouring
+     * buckets until each group holds enough transactions, and stop at the
+     * first group in which fewer than successBreakPoint of the transactions
+     * confirmed within confTarget blocks. Returns the average value of the
+     * median transaction of the last group that passed, or -1.
+     */
+    double EstimateMedianVal(int confTarget, double sufficientTxVal, double successBreakPoint, unsigned int nBlockHeight) const
     {
-        for (double priority : vecPriority) {
-            if (!AreSane(priority))
-                return false;
+        double nConf = 0, totalNum = 0;
+        int extraNum = 0;
+        const double nSufficient = sufficientTxVal / (1 - decay);
+        const int maxbucketindex = buckets.size() - 1;
+
+        unsigned int curNearBucket = maxbucketindex, bestNearBucket = maxbucketindex;
+        unsigned int curFarBucket = maxbucketindex, bestFarBucket = maxbucketindex;
+        bool foundAnswer = false;
+        const unsigned int bins = unconfTxs.size();
+
+        for (int bucket = maxbucketindex; bucket >= 0; bucket--) {
+            curFarBucket = bucket;
+            nConf += confAvg[confTarget - 1][bucket];
+            totalNum += txCtAvg[bucket];
+            // Transactions still waiting after confTarget blocks count as failures
+            for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
+                extraNum += unconfTxs[(nBlockHeight - confct) % bins][bucket];
+            extraNum += oldUnconfTxs[bucket];
+
+            if (totalNum >= nSufficient) {
+                double curPct = nConf / (totalNum + extraNum);
+                if (curPct < successBreakPoint)
+                    break;
+                foundAnswer = true;
+                nConf = 0;
+                totalNum = 0;
+                extraNum = 0;
+                bestNearBucket = curNearBucket;
+                bestFarBucket = curFarBucket;
+                curNearBucket = bucket - 1;
+            }
         }
-        return true;
+
+        double median = -1;
+        double txSum = 0;
+        unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
+        unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
+        for (unsigned int j = minBucket; j <= maxBucket; j++)
+            txSum += txCtAvg[j];
+        if (foundAnswer && txSum != 0) {
+            txSum = txSum / 2;
+            for (unsigned int j = minBucket; j <= maxBucket; j++) {
+                if (txCtAvg[j] < txSum) {
+                    txSum -= txCtAvg[j];
+                } else {
+                    median = avg[j] / txCtAvg[j];
+                    break;
+                }
+            }
+        }
+
+        LogPrint("estimatefee", "%3d: For conf success > %4.2f need %s >: %12.5g from buckets %8g - %8g\n",
+            confTarget, successBreakPoint, dataTypeString, median, buckets[minBucket], buckets[maxBucket]);
+        return median;
     }
 
     void Write(CAutoFile& fileout) const
     {
-        std::vector<CFeeRate> vecFee = buf2vec(feeSamples);
-        fileout << vecFee;
-        std::vector<double> vecPriority = buf2vec(prioritySamples);
-        fileout << vecPriority;
+        fileout << decay;
+        fileout << buckets;
+        fileout << avg;
+        fileout << txCtAvg;
+        fileout << confAvg;
     }
 
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee)
+    void Read(CAutoFile& filein)
     {
-        std::vector<CFeeRate> vecFee;
-        filein >> vecFee;
-        if (AreSane(vecFee, minRelayFee))
-            feeSamples.insert(feeSamples.end(), vecFee.begin(), vecFee.end());
-        else
-            throw runtime_error("Corrupt fee value in estimates file.");
-        std::vector<double> vecPriority;
-        filein >> vecPriority;
-        if (AreSane(vecPriority))
-            prioritySamples.insert(prioritySamples.end(), vecPriority.begin(), vecPriority.end());
-        else
-            throw runtime_error("Corrupt priority value in estimates file.");
-        if (feeSamples.size() + prioritySamples.size() > 0)
-            LogPrint("estimatefee", "Read %d fee samples and %d priority samples\n",
-                feeSamples.size(), prioritySamples.size());
+        double fileDecay;
+        std::vector<double> fileBuckets, fileAvg, fileTxCtAvg;
+        std::vector<std::vector<double> > fileConfAvg;
+        filein >> fileDecay;
+        if (fileDecay <= 0 || fileDecay >= 1)
+            throw runtime_error("Corrupt estimates file. Decay must be between 0 and 1 (non-inclusive)");
+        filein >> fileBuckets;
+        if (fileBuckets.size() <= 1 || fileBuckets.size() > 1000)
+            throw runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
+        filein >> fileAvg;
+        filein >> fileTxCtAvg;
+        filein >> fileConfAvg;
+        if (fileAvg.size() != fileBuckets.size() || fileTxCtAvg.size() != fileBuckets.size())
+            throw runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
+        if (fileConfAvg.size() == 0 || fileConfAvg.size() > 6 * 24 * 7)
+            throw runtime_error("Corrupt estimates file. Must maintain estimates for between 1 and 1008 (one week) confirms");
+        for (const std::vector<double>& conf : fileConfAvg) {
+            if (conf.size() != fileBuckets.size())
+                throw runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
+        }
+
+        // Now that the whole section has been read, start over with its
+        // buckets; unconfirmed counts are rebuilt as transactions arrive
+        Initialize(fileBuckets, fileConfAvg.size(), fileDecay, dataTypeString);
+        avg = fileAvg;
+        txCtAvg = fileTxCtAvg;
+        confAvg = fileConfAvg;
+
+        LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
+            buckets.size(), dataTypeString, confAvg.size());
     }
 };
 
+/** Fee rates (satoshis per kB) at which the lowest and highest buckets start, and the spacing between them */
+static const double MIN_FEERATE = 10;
+static const double MAX_FEERATE = 1e8;
+static const double INF_FEERATE = 1e99;
+static const double FEE_SPACING = 1.1;
+/** Same for priorities */
+static const double MIN_PRIORITY = 10;
+static const double MAX_PRIORITY = 1e16;
+static const double INF_PRIORITY = 1e99;
+static const double PRI_SPACING = 2;
+/** Minimum client version able to read the bucketed fee estimates file (2.5.1.1); older clients refuse it */
+static const int FEE_ESTIMATES_VERSION = 2050101;
+/** Decay of the moving averages per block, a half life of about 350 blocks */
+static const double DEFAULT_DECAY = .998;
+/** Share of a bucket group's transactions that must have confirmed within the target */
+static const double MIN_SUCCESS_PCT = .85;
+/** Decayed transactions per block a bucket group needs before it is used */
+static const double SUFFICIENT_FEETXS = 1;
+static const double SUFFICIENT_PRITXS = .2;
+
 class CMinerPolicyEstimator
 {
 private:
-    /**
-     * Records observed averages transactions that confirmed within one block, two blocks,
-     * three blocks etc.
-     */
-    std::vector<CBlockAverage> history;
-    std::vector<CFeeRate> sortedFeeSamples;
-    std::vector<double> sortedPrioritySamples;
+    struct TxStatsInfo {
+        TxConfirmStats* stats;
+        unsigned int blockHeight;
+        unsigned int bucketIndex;
+        TxStatsInfo() : stats(NULL), blockHeight(0), bucketIndex(0) {}
+    };
 
-    int nBestSeenHeight;
+    //! Mempool transactions being tracked, and the stats they were counted in
+    std::map<uint256, TxStatsInfo> mapMemPoolTxs;
 
-    /**
-     * nBlocksAgo is 0 based, i.e. transactions that confirmed in the highest seen block are
-     * nBlocksAgo == 0, transactions in the block before that are nBlocksAgo == 1 etc.
-     */
-    void seenTxConfirm(const CFeeRate& feeRate, const CFeeRate& minRelayFee, double dPriority, int nBlocksAgo)
+    TxConfirmStats feeStats;
+    TxConfirmStats priStats;
+
+    CFeeRate minTrackedFee;
+    unsigned int nBestSeenHeight;
+
+    void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
     {
-        // Last entry records "everything else".
-        int nBlocksTruncated = min(nBlocksAgo, (int)history.size() - 1);
-        assert(nBlocksTruncated >= 0);
+        std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(entry.GetTx().GetHash());
+        if (pos == mapMemPoolTxs.end())
+            return;
+
+        // How many blocks did it take for miners to include this transaction?
+        int nBlocksToConfirm = nBlockHeight - pos->second.blockHeight;
+        if (nBlocksToConfirm > 0) {
+            if (pos->second.stats == &feeStats)
+                feeStats.Record(nBlocksToConfirm, (double)CFeeRate(entry.GetFee(), entry.GetTxSize()).GetFeePerK());
+            else
+                priStats.Record(nBlocksToConfirm, entry.GetPriority(pos->second.blockHeight));
+        }
+        pos->second.stats->RemoveTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
+        mapMemPoolTxs.erase(pos);
+    }
 
-        // We need to guess why the transaction was included in a block-- either
-        // because it is high-priority or because it has sufficient fees.
-        bool sufficientFee = (feeRate > minRelayFee);
+public:
+    CMinerPolicyEstimator(const CFeeRate& minRelayFee, unsigned int nMaxConfirms) : nBestSeenHeight(0)
+    {
+        minTrackedFee = minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : minRelayFee;
+        std::vector<double> vfeelist;
+        for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING)
+            vfeelist.push_back(bucketBoundary);
+        vfeelist.push_back(INF_FEERATE);
+        feeStats.Initialize(vfeelist, nMaxConfirms, DEFAULT_DECAY, "FeeRate");
+
+        std::vector<double> vprilist;
+        for (double bucketBoundary = MIN_PRIORITY; bucketBoundary <= MAX_PRIORITY; bucketBoundary *= PRI_SPACING)
+            vprilist.push_back(bucketBoundary);
+        vprilist.push_back(INF_PRIORITY);
+        priStats.Initialize(vprilist, nMaxConfirms, DEFAULT_DECAY, "Priority");
+    }
+
+    /** A transaction entered the pool. Only transactions accepted while in sync give current estimates */
+    void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+    {
+        const uint256& hash = entry.GetTx().GetHash();
+        if (mapMemPoolTxs.count(hash) || !fCurrentEstimate)
+            return;
+        unsigned int txHeight = entry.GetHeight();
+        if (txHeight < nBestSeenHeight) {
+            // Ignore transactions accepted at an old height, e.g. while
+            // resurrecting them during a re-org
+            return;
+        }
+
+        // We need to guess why the transaction will be included in a block:
+        // either because it is high-priority or because it has sufficient fees.
+        CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+        double dPriority = entry.GetPriority(txHeight);
+        bool sufficientFee = feeRate >= minTrackedFee;
         bool sufficientPriority = AllowFree(dPriority);
-        const char* assignedTo = "unassigned";
-        if (sufficientFee && !sufficientPriority && CBlockAverage::AreSane(feeRate, minRelayFee)) {
-            history[nBlocksTruncated].RecordFee(feeRate);
-            assignedTo = "fee";
-        } else if (sufficientPriority && !sufficientFee && CBlockAverage::AreSane(dPriority)) {
-            history[nBlocksTruncated].RecordPriority(dPriority);
-            assignedTo = "priority";
+        TxStatsInfo& info = mapMemPoolTxs[hash];
+        info.blockHeight = txHeight;
+        if (sufficientFee && !sufficientPriority) {
+            info.stats = &feeStats;
+            info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        } else if (sufficientPriority && !sufficientFee) {
+            info.stats = &priStats;
+            info.bucketIndex = priStats.NewTx(txHeight, dPriority);
         } else {
             // Neither or both fee and priority sufficient to get confirmed:
-            // don't know why they got confirmed.
+            // don't know why they would get confirmed.
+            mapMemPoolTxs.erase(hash);
         }
-        LogPrint("estimatefee", "Seen TX confirm: %s : %s fee/%g priority, took %d blocks\n",
-            assignedTo, feeRate.ToString(), dPriority, nBlocksAgo);
     }
 
-public:
-    CMinerPolicyEstimator(int nEntries) : nBestSeenHeight(0)
+    /** A transaction left the pool without being mined */
+    void removeTx(const uint256& hash)
     {
-        history.resize(nEntries);
+        std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
+        if (pos == mapMemPoolTxs.end())
+            return;
+        pos->second.stats->RemoveTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
+        mapMemPoolTxs.erase(pos);
     }
 
-    void seenBlock(const std::vector<CTxMemPoolEntry>& entries, int nBlockHeight, const CFeeRate minRelayFee)
+    /** A block was connected; entries are the pool's copies of its transactions */
+    void processBlock(unsigned int nBlockHeight, const std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
     {
         if (nBlockHeight <= nBestSeenHeight) {
             // Ignore side chains and re-orgs; assuming they are random
@@ -210,155 +444,96 @@ public:
         }
         nBestSeenHeight = nBlockHeight;
 
-        // Fill up the history buckets based on how long transactions took
-        // to confirm.
-        std::vector<std::vector<const CTxMemPoolEntry*> > entriesByConfirmations;
-        entriesByConfirmations.resize(history.size());
-        for (const CTxMemPoolEntry& entry : entries) {
-            // How many blocks did it take for miners to include this transaction?
-            int delta = nBlockHeight - entry.GetHeight();
-            if (delta <= 0) {
-                // Re-org made us lose height, this should only happen if we happen
-                // to re-org on a difficulty transition point: very rare!
-                continue;
-            }
-            if ((delta - 1) >= (int)history.size())
-                delta = history.size(); // Last bucket is catch-all
-            entriesByConfirmations.at(delta - 1).push_back(&entry);
-        }
-        for (size_t i = 0; i < entriesByConfirmations.size(); i++) {
-            std::vector<const CTxMemPoolEntry*>& e = entriesByConfirmations.at(i);
-            // Insert at most 10 random entries per bucket, otherwise a single block
-            // can dominate an estimate:
-            if (e.size() > 10) {
-                std::random_shuffle(e.begin(), e.end());
-                e.resize(10);
-            }
-            for (const CTxMemPoolEntry* entry : e) {
-                // Fees are stored and reported as BTC-per-kb:
-                CFeeRate feeRate(entry->GetFee(), entry->GetTxSize());
-                double dPriority = entry->GetPriority(entry->GetHeight()); // Want priority when it went IN
-                seenTxConfirm(feeRate, minRelayFee, dPriority, i);
-            }
-        }
+        // Only blocks connected while in sync say how long transactions wait
+        if (!fCurrentEstimate)
+            return;
 
-        //After new samples are added, we have to clear the sorted lists,
-        //so they'll be resorted the next time someone asks for an estimate
-        sortedFeeSamples.clear();
-        sortedPrioritySamples.clear();
-
-        for (size_t i = 0; i < history.size(); i++) {
-            if (history[i].FeeSamples() + history[i].PrioritySamples() > 0)
-                LogPrint("estimatefee", "estimates: for confirming within %d blocks based on %d/%d samples, fee=%s, prio=%g\n",
-                    i,
-                    history[i].FeeSamples(), history[i].PrioritySamples(),
-                    estimateFee(i + 1).ToString(), estimatePriority(i + 1));
-        }
+        feeStats.ClearCurrent(nBlockHeight);
+        priStats.ClearCurrent(nBlockHeight);
+        for (const CTxMemPoolEntry& entry : entries)
+            processBlockTx(nBlockHeight, entry);
+        feeStats.UpdateMovingAverages();
+        priStats.UpdateMovingAverages();
+
+        LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
+            entries.size(), mapMemPoolTxs.size());
     }
 
     /**
-     * Can return CFeeRate(0) if we don't have any data for that many blocks back. nBlocksToConfirm is 1 based.
+     * Can return CFeeRate(0) if we don't have enough data for that many blocks. nBlocksToConfirm is 1 based.
      */
-    CFeeRate estimateFee(int nBlocksToConfirm)
+    CFeeRate estimateFee(int nBlocksToConfirm) const
     {
-        nBlocksToConfirm--;
-
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
+        if (nBlocksToConfirm <= 0 || (unsigned int)nBlocksToConfirm > feeStats.GetMaxConfirms())
             return CFeeRate(0);
-
-        if (sortedFeeSamples.size() == 0) {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetFeeSamples(sortedFeeSamples);
-            std::sort(sortedFeeSamples.begin(), sortedFeeSamples.end(),
-                std::greater<CFeeRate>());
-        }
-        if (sortedFeeSamples.size() < 11) {
-            // Eleven is Gavin's Favorite Number
-            // ... but we also take a maximum of 10 samples per block so eleven means
-            // we're getting samples from at least two different blocks
+        double median = feeStats.EstimateMedianVal(nBlocksToConfirm, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, nBestSeenHeight);
+        if (median < 0)
             return CFeeRate(0);
-        }
-
-        int nBucketSize = history.at(nBlocksToConfirm).FeeSamples();
-
-        // Estimates should not increase as number of confirmations goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous bucket +
-        // half the samples in nBlocksToConfirm bucket):
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).FeeSamples();
-        size_t index = min(nPrevSize + nBucketSize / 2, sortedFeeSamples.size() - 1);
-        return sortedFeeSamples[index];
+        return CFeeRate(median);
     }
-    double estimatePriority(int nBlocksToConfirm)
+
+    /**
+     * Like estimateFee, but when there is too little data for nBlocksToConfirm
+     * the next longer targets are tried. *pnAnswerFoundAt receives the target
+     * that gave the estimate.
+     */
+    CFeeRate estimateSmartFee(int nBlocksToConfirm, int* pnAnswerFoundAt) const
     {
-        nBlocksToConfirm--;
+        if (nBlocksToConfirm <= 0)
+            nBlocksToConfirm = 1;
+        if ((unsigned int)nBlocksToConfirm > feeStats.GetMaxConfirms())
+            nBlocksToConfirm = feeStats.GetMaxConfirms();
+        CFeeRate feeRate(0);
+        while (feeRate == CFeeRate(0) && (unsigned int)nBlocksToConfirm <= feeStats.GetMaxConfirms())
+            feeRate = estimateFee(nBlocksToConfirm++);
+        if (pnAnswerFoundAt)
+            *pnAnswerFoundAt = feeRate == CFeeRate(0) ? 0 : nBlocksToConfirm - 1;
+        return feeRate;
+    }
 
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
+    double estimatePriority(int nBlocksToConfirm) const
+    {
+        if (nBlocksToConfirm <= 0 || (unsigned int)nBlocksToConfirm > priStats.GetMaxConfirms())
             return -1;
-
-        if (sortedPrioritySamples.size() == 0) {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetPrioritySamples(sortedPrioritySamples);
-            std::sort(sortedPrioritySamples.begin(), sortedPrioritySamples.end(),
-                std::greater<double>());
-        }
-        if (sortedPrioritySamples.size() < 11)
-            return -1.0;
-
-        int nBucketSize = history.at(nBlocksToConfirm).PrioritySamples();
-
-        // Estimates should not increase as number of confirmations needed goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous buckets +
-        // half the samples in nBlocksToConfirm bucket).
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).PrioritySamples();
-        size_t index = min(nPrevSize + nBucketSize / 2, sortedPrioritySamples.size() - 1);
-        return sortedPrioritySamples[index];
+        return priStats.EstimateMedianVal(nBlocksToConfirm, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, nBestSeenHeight);
     }
 
     void Write(CAutoFile& fileout) const
     {
         fileout << nBestSeenHeight;
-        fileout << history.size();
-        for (const CBlockAverage& entry : history) {
-            entry.Write(fileout);
-        }
+        feeStats.Write(fileout);
+        priStats.Write(fileout);
     }
 
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee)
+    void Read(CAutoFile& filein)
     {
-        int nFileBestSeenHeight;
+        unsigned int nFileBestSeenHeight;
         filein >> nFileBestSeenHeight;
-        size_t numEntries;
-        filein >> numEntries;
-        if (numEntries <= 0 || numEntries > 10000)
-            throw runtime_error("Corrupt estimates file. Must have between 1 and 10k entries.");
-
-        std::vector<CBlockAverage> fileHistory;
-
-        for (size_t i = 0; i < numEntries; i++) {
-            CBlockAverage entry;
-            entry.Read(filein, minRelayFee);
-            fileHistory.push_back(entry);
-        }
+        TxConfirmStats fileFeeStats = feeStats, filePriStats = priStats;
+        fileFeeStats.Read(filein);
+        filePriStats.Read(filein);
+        if (fileFeeStats.GetMaxConfirms() != filePriStats.GetMaxConfirms())
+            throw runtime_error("Corrupt estimates file. Fee and priority stats track different targets");
 
         // Now that we've processed the entire fee estimate data file and not
-        // thrown any errors, we can copy it to our history
+        // thrown any errors, we can replace our stats. Transactions tracked
+        // so far were counted in the old buckets and are dropped.
+        mapMemPoolTxs.clear();
+        feeStats = fileFeeStats;
+        priStats = filePriStats;
         nBestSeenHeight = nFileBestSeenHeight;
-        history = fileHistory;
-        assert(history.size() > 0);
     }
 };
 
-
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       rollingMinimumFeeRate(0),
+                                                       nEvictedTotal(0),
+                                                       nExpiredTotal(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -370,7 +545,7 @@ CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
     // to wait a day or two to save a fraction of a penny in fees.
     // Confirmation times for very-low-fee transactions that take more
     // than an hour or three to confirm are highly variable.
-    minerPolicyEstimator = new CMinerPolicyEstimator(25);
+    minerPolicyEstimator = new CMinerPolicyEstimator(_minRelayFee, 25);
 }
 
 CTxMemPool::~CTxMemPool()
@@ -404,32 +579,298 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    txlinksMap::iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    setEntries& s = it->second.parents;
+    if (add && s.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
+    else if (!add && s.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    txlinksMap::iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    setEntries& s = it->second.children;
+    if (add && s.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
+    else if (!add && s.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, bool fSearchForParents) const
+{
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, fSearchForParents);
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents) const
+{
+    AssertLockHeld(cs);
+    setEntries parents;
+    if (fSearchForParents) {
+        // entry may not be in the pool yet, look its parents up by its inputs
+        for (const CTxIn& txin : entry.GetTx().vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end()) {
+                parents.insert(piter);
+                if (parents.size() + 1 > limitAncestorCount) {
+                    errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+                    return false;
+                }
+            }
+        }
+    } else {
+        parents = GetMemPoolParents(mapTx.iterator_to(entry));
+    }
+
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    while (!parents.empty()) {
+        txiter stageit = *parents.begin();
+        parents.erase(parents.begin());
+        setAncestors.insert(stageit);
+        nSizeWithAncestors += stageit->GetTxSize();
+
+        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
+            return false;
+        } else if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantCount);
+            return false;
+        } else if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        for (txiter piter : GetMemPoolParents(stageit)) {
+            if (!setAncestors.count(piter))
+                parents.insert(piter);
+            if (parents.size() + setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants) const
+{
+    AssertLockHeld(cs);
+    setEntries stage;
+    if (!setDescendants.count(entryit))
+        stage.insert(entryit);
+    // Traverse down the children of entry, only adding children that are not already accounted for
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        stage.erase(stage.begin());
+        setDescendants.insert(it);
+        for (txiter childit : GetMemPoolChildren(it)) {
+            if (!setDescendants.count(childit))
+                stage.insert(childit);
+        }
+    }
+}
+
+/** Add or remove it from the descendant totals of its ancestors and the child links of its parents */
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors)
+{
+    for (txiter piter : GetMemPoolParents(it))
+        UpdateChild(piter, it, add);
+    const int64_t nUpdateCount = (add ? 1 : -1);
+    const int64_t nUpdateSize = nUpdateCount * it->GetTxSize();
+    const CAmount nUpdateFee = nUpdateCount * it->GetModifiedFee();
+    for (txiter ancestorit : setAncestors)
+        mapTx.modify(ancestorit, update_descendant_state(nUpdateSize, nUpdateFee, nUpdateCount));
+}
+
+void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries& setAncestors)
+{
+    int64_t nUpdateCount = setAncestors.size();
+    int64_t nUpdateSize = 0;
+    CAmount nUpdateFee = 0;
+    for (txiter ancestorit : setAncestors) {
+        nUpdateSize += ancestorit->GetTxSize();
+        nUpdateFee += ancestorit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nUpdateSize, nUpdateFee, nUpdateCount));
+}
+
+/** Recompute the ancestor and descendant totals of it from the links */
+void CTxMemPool::RecalculatePackageState(txiter it)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(*it, setAncestors, false);
+    int64_t nSize = it->GetTxSize();
+    CAmount nFee = it->GetModifiedFee();
+    for (txiter ancestorit : setAncestors) {
+        nSize += ancestorit->GetTxSize();
+        nFee += ancestorit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nSize - it->GetSizeWithAncestors(), nFee - it->GetModFeesWithAncestors(),
+                         (int64_t)setAncestors.size() + 1 - it->GetCountWithAncestors()));
+
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    nSize = 0;
+    nFee = 0;
+    for (txiter descendantit : setDescendants) {
+        nSize += descendantit->GetTxSize();
+        nFee += descendantit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_descendant_state(nSize - it->GetSizeWithDescendants(), nFee - it->GetModFeesWithDescendants(),
+                         (int64_t)setDescendants.size() - it->GetCountWithDescendants()));
+}
+
+/**
+ * A transaction resurrected from a disconnected block can already have children in the pool.
+ * Link them, then recompute the totals of everything whose package it joined. Only reorgs
+ * take this path, so the totals are simply recounted.
+ */
+void CTxMemPool::UpdateForChildrenInPool(txiter it)
+{
+    const uint256& hash = it->GetTx().GetHash();
+    std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(hash, 0));
+    if (iter == mapNextTx.end() || iter->first.hash != hash)
+        return;
+    for (; iter != mapNextTx.end() && iter->first.hash == hash; ++iter) {
+        txiter childit = mapTx.find(iter->second.ptx->GetHash());
+        assert(childit != mapTx.end());
+        UpdateChild(it, childit, true);
+        UpdateParent(childit, it, true);
+    }
+
+    setEntries setPackage;
+    CalculateMemPoolAncestors(*it, setPackage, false);
+    CalculateDescendants(it, setPackage);
+    for (txiter packageit : setPackage)
+        RecalculatePackageState(packageit);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+{
+    LOCK(cs);
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(entry, setAncestors);
+    return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
-        nTransactionsUpdated++;
-        totalTxSize += entry.GetTxSize();
+    std::pair<txiter, bool> ret = mapTx.insert(entry);
+    if (!ret.second)
+        return false;
+    txiter newit = ret.first;
+    mapLinks.insert(make_pair(newit, TxLinks()));
+
+    // Apply the fee delta of an earlier PrioritiseTransaction
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        txiter piter = mapTx.find(tx.vin[i].prevout.hash);
+        if (piter != mapTx.end())
+            UpdateParent(newit, piter, true);
     }
+    UpdateAncestorsOf(true, newit, setAncestors);
+    UpdateEntryForAncestors(newit, setAncestors);
+    UpdateForChildrenInPool(newit);
+
+    nTransactionsUpdated++;
+    totalTxSize += entry.GetTxSize();
+    cachedInnerUsage += entry.DynamicMemoryUsage();
+    minerPolicyEstimator->processTransaction(*newit, fCurrentEstimate);
     return true;
 }
 
+void CTxMemPool::UpdateChildrenForRemoval(txiter it)
+{
+    for (txiter childit : GetMemPoolChildren(it))
+        UpdateParent(childit, it, false);
+}
+
+void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool fUpdateDescendants)
+{
+    if (fUpdateDescendants) {
+        // Descendants that stay lose the removed transactions from their ancestor totals
+        for (txiter removeit : entriesToRemove) {
+            setEntries setDescendants;
+            CalculateDescendants(removeit, setDescendants);
+            setDescendants.erase(removeit);
+            int64_t nModifySize = -((int64_t)removeit->GetTxSize());
+            CAmount nModifyFee = -removeit->GetModifiedFee();
+            for (txiter descendantit : setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(nModifySize, nModifyFee, -1));
+        }
+    }
+    for (txiter removeit : entriesToRemove) {
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(*removeit, setAncestors, false);
+        UpdateAncestorsOf(false, removeit, setAncestors);
+    }
+    // Parent links are dropped last, the ancestor walks above still need them
+    for (txiter removeit : entriesToRemove)
+        UpdateChildrenForRemoval(removeit);
+}
+
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    for (const CTxIn& txin : it->GetTx().vin)
+        mapNextTx.erase(txin.prevout);
+
+    totalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->DynamicMemoryUsage();
+    txlinksMap::iterator linksit = mapLinks.find(it);
+    cachedInnerUsage -= memusage::DynamicUsage(linksit->second.parents) + memusage::DynamicUsage(linksit->second.children);
+    mapLinks.erase(linksit);
+    minerPolicyEstimator->removeTx(it->GetTx().GetHash());
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+}
+
+void CTxMemPool::RemoveStaged(const setEntries& stage, bool fUpdateDescendants)
+{
+    AssertLockHeld(cs);
+    UpdateForRemoveFromMempool(stage, fUpdateDescendants);
+    for (txiter it : stage)
+        removeUnchecked(it);
+}
 
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -438,31 +879,21 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty()) {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            for (const CTxIn& txin : tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            for (txiter it : txToRemove)
+                CalculateDescendants(it, setAllRemoves);
+        } else {
+            setAllRemoves.swap(txToRemove);
         }
+        for (txiter it : setAllRemoves)
+            removed.push_back(it->GetTx());
+        RemoveStaged(setAllRemoves, !fRecursive);
     }
 }
 
@@ -471,11 +902,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         for (const CTxIn& txin : tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
-            if (it2 != mapTx.end())
+            if (mapTx.count(txin.prevout.hash))
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
             if (fSanityCheck) assert(coins);
@@ -510,31 +940,38 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts)
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
     for (const CTransaction& tx : vtx) {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(*it);
     }
-    minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
+    minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
     for (const CTransaction& tx : vtx) {
         std::list<CTransaction> dummy;
         remove(tx, dummy, false);
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -546,23 +983,27 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
+        setEntries setParentCheck;
         for (const CTxIn& txin : tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -574,8 +1015,45 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+        innerUsage += memusage::DynamicUsage(GetMemPoolParents(it)) + memusage::DynamicUsage(GetMemPoolChildren(it));
+
+        // Check the ancestor totals
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(*it, setAncestors);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        for (txiter ancestorit : setAncestors) {
+            nSizeCheck += ancestorit->GetTxSize();
+            nFeesCheck += ancestorit->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        // Check the children against mapNextTx, and the descendant totals
+        setEntries setChildrenCheck;
+        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(tx.GetHash(), 0));
+        for (; iter != mapNextTx.end() && iter->first.hash == tx.GetHash(); ++iter) {
+            txiter childit = mapTx.find(iter->second.ptx->GetHash());
+            assert(childit != mapTx.end());
+            setChildrenCheck.insert(childit);
+        }
+        assert(setChildrenCheck == GetMemPoolChildren(it));
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        for (txiter descendantit : setDescendants) {
+            nSizeCheck += descendantit->GetTxSize();
+            nFeesCheck += descendantit->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             CTxUndo undo;
@@ -601,15 +1079,17 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(mapLinks.size() == mapTx.size());
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -618,24 +1098,38 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    txiter i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    txiter i = mapTx.find(hash);
+    if (i == mapTx.end())
+        return nullptr;
+    return i->GetSharedTx();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
     return minerPolicyEstimator->estimateFee(nBlocks);
 }
+CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int* pnAnswerFoundAt) const
+{
+    LOCK(cs);
+    return minerPolicyEstimator->estimateSmartFee(nBlocks, pnAnswerFoundAt);
+}
 double CTxMemPool::estimatePriority(int nBlocks) const
 {
     LOCK(cs);
@@ -646,7 +1140,7 @@ bool CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 {
     try {
         LOCK(cs);
-        fileout << 120000;         // version required to read: 0.12.00 or later
+        fileout << FEE_ESTIMATES_VERSION; // version required to read
         fileout << CLIENT_VERSION; // version that wrote the file
         minerPolicyEstimator->Write(fileout);
     } catch (const std::exception&) {
@@ -663,9 +1157,13 @@ bool CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
         filein >> nVersionRequired >> nVersionThatWrote;
         if (nVersionRequired > CLIENT_VERSION)
             return error("CTxMemPool::ReadFeeEstimates() : up-version (%d) fee estimate file", nVersionRequired);
+        if (nVersionRequired < FEE_ESTIMATES_VERSION) {
+            LogPrintf("CTxMemPool::ReadFeeEstimates() : ignoring fee estimates in the old per-block sample format\n");
+            return false;
+        }
 
         LOCK(cs);
-        minerPolicyEstimator->Read(filein, minRelayFee);
+        minerPolicyEstimator->Read(filein);
     } catch (const std::exception&) {
         LogPrintf("CTxMemPool::ReadFeeEstimates() : unable to read policy estimator data (non-fatal)");
         return false;
@@ -680,6 +1178,20 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // The packages it belongs to change fee with it
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(*it, setAncestors, false);
+            for (txiter ancestorit : setAncestors)
+                mapTx.modify(ancestorit, update_descendant_state(0, nFeeDelta, 0));
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            for (txiter descendantit : setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -701,6 +1213,91 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // The new pool minimum is the fee rate of the evicted package plus the relay fee,
+        // so a transaction paying what was just evicted can't take its place before a block.
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed += minRelayFee;
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        RemoveStaged(stage, false);
+    }
+    nEvictedTotal += nTxnRemoved;
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+    setEntries stage;
+    for (txiter removeit : toremove)
+        CalculateDescendants(removeit, stage);
+    RemoveStaged(stage, false);
+    nExpiredTotal += stage.size();
+    return stage.size();
+}
+
 
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) {}
 
@@ -709,9 +1306,9 @@ bool CCoinsViewMemPool::GetCoins(const uint256& txid, CCoins& coins) const
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
+    CTransactionRef ptx = mempool.get(txid);
+    if (ptx) {
+        coins = CCoins(*ptx, MEMPOOL_HEIGHT);
         return true;
     }
     return (base->GetCoins(txid, coins) && !coins.IsPruned());
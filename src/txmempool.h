@@ -10,12 +10,18 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -36,29 +42,200 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry keeps the totals (count, size and modified fee)
+ * of the package it forms with its in-mempool ancestors and with its in-mempool descendants.
+ * CTxMemPool keeps them current as transactions are added and removed, so the fee rate
+ * orderings over packages never have to be recomputed by walking the pool.
  */
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;   //! Shared with the relay and orphan code rather than copied
     CAmount nFee;         //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;       //! ... and avoid recomputing tx size
     size_t nModSize;      //! ... and modified size for priority
+    size_t nUsageSize;    //! ... and total memory usage
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee delta from PrioritiseTransaction
+    unsigned int nSigOps; //! Legacy and P2SH sigops, so block assembly needs no coins view
+
+    //! This transaction and all its in-mempool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+
+    //! This transaction and all its in-mempool ancestors
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
 public:
-    CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight, unsigned int _nSigOps);
+    CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight, unsigned int _nSigOps);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    CTransactionRef GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    unsigned int GetSigOpCount() const { return nSigOps; }
+
+    //! Fee including the PrioritiseTransaction delta; all package totals use this
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+    void UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state {
+    update_descendant_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct update_fee_delta {
+    update_fee_delta(CAmount _nFeeDelta) : nFeeDelta(_nFeeDelta) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(nFeeDelta); }
+
+private:
+    CAmount nFeeDelta;
+};
+
+//! Extracts the txid of a CTxMemPoolEntry, the key of the hashed index of mapTx
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    const result_type& operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Salted hash of a txid, so peers can't pick txids that collide in the hashed index */
+class SaltedTxidHasher
+{
+private:
+    uint256 salt;
+
+public:
+    SaltedTxidHasher();
+
+    size_t operator()(const uint256& txid) const
+    {
+        return txid.GetHash(salt);
+    }
+};
+
+/**
+ * Sort by the higher of the transaction's own modified fee rate and the fee rate of it with
+ * its descendants, lowest first, so the first entry is the cheapest package to evict.
+ * Among equal scores newer transactions come first.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees, aSize, bFees, bSize;
+        GetScore(a, aFees, aSize);
+        GetScore(b, bFees, bSize);
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 != f2)
+            return f1 < f2;
+        if (a.GetTime() != b.GetTime())
+            return a.GetTime() > b.GetTime();
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
+
+    static void GetScore(const CTxMemPoolEntry& e, double& fees, double& size)
+    {
+        // Use the package fee rate if it is higher than the transaction's own
+        if ((double)e.GetModFeesWithDescendants() * e.GetTxSize() > (double)e.GetModifiedFee() * e.GetSizeWithDescendants()) {
+            fees = e.GetModFeesWithDescendants();
+            size = e.GetSizeWithDescendants();
+        } else {
+            fees = e.GetModifiedFee();
+            size = e.GetTxSize();
+        }
+    }
+};
+
+/** Sort by modified fee rate, highest first */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 != f2)
+            return f1 > f2;
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
+};
+
+/** Sort by the fee rate of the transaction together with its in-mempool ancestors, highest first */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 != f2)
+            return f1 > f2;
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
+};
+
+/** Sort by the time the transaction entered the mempool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+// Tags of the ordered indexes of CTxMemPool::mapTx
+struct descendant_score {
+};
+struct mining_score {
+};
+struct ancestor_score {
+};
+struct entry_time {
 };
 
 class CMinerPolicyEstimator;
@@ -103,13 +280,88 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    //! Rolling minimum fee rate, raised when TrimToSize evicts and halved every ROLLING_FEE_HALFLIFE after a block
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate;
+
+    uint64_t nEvictedTotal; //! transactions removed by TrimToSize since startup
+    uint64_t nExpiredTotal; //! transactions removed by Expire since startup
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
+    /**
+     * mapTx indexes the entries by txid and orders them by descendant score (for eviction),
+     * by entry time (for expiry), by modified fee rate and by ancestor package fee rate (for
+     * block assembly). Entries are only changed through mapTx.modify so the orderings stay valid.
+     */
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<mempoolentry_txid, SaltedTxidHasher>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime>,
+            // sorted by modified fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore>,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    //! In-mempool parents and children of each entry
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    void UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors);
+    void UpdateEntryForAncestors(txiter it, const setEntries& setAncestors);
+    void UpdateForChildrenInPool(txiter it);
+    void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool fUpdateDescendants);
+    void UpdateChildrenForRemoval(txiter it);
+    void RecalculatePackageState(txiter it);
+    void removeUnchecked(txiter it);
+
+public:
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -122,11 +374,18 @@ public:
     void check(const CCoinsViewCache* pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
-    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, bool fCurrentEstimate = true);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors, bool fCurrentEstimate = true);
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
+    /**
+     * Remove a set of transactions. With fUpdateDescendants, in-mempool descendants that are
+     * not in stage have the removed transactions taken out of their ancestor totals; without,
+     * stage must hold every descendant of the transactions in it.
+     */
+    void RemoveStaged(const setEntries& stage, bool fUpdateDescendants);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts);
+    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins& coins);
@@ -138,6 +397,21 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Evict the lowest descendant score packages until the pool uses no more than sizelimit
+     * bytes, raising the rolling minimum fee rate above the fee rate of each evicted package.
+     */
+    void TrimToSize(size_t sizelimit);
+
+    /** Expire all transactions (and their descendants) that entered the pool before time. Returns the number removed. */
+    int Expire(int64_t time);
+
+    /**
+     * The minimum fee rate to get into the pool, which rises after evictions and decays
+     * once blocks have been seen. sizelimit is the pool limit, a pool well below it decays faster.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -148,6 +422,16 @@ public:
         LOCK(cs);
         return totalTxSize;
     }
+    uint64_t GetEvictedTotal()
+    {
+        LOCK(cs);
+        return nEvictedTotal;
+    }
+    uint64_t GetExpiredTotal()
+    {
+        LOCK(cs);
+        return nExpiredTotal;
+    }
 
     bool exists(uint256 hash)
     {
@@ -156,10 +440,33 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    CTransactionRef get(const uint256& hash) const;
+
+    /** Collect the in-mempool ancestors of entry, which need not be in the pool yet */
+    void CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, bool fSearchForParents = true) const;
+    /**
+     * As above, but stop and fill errString as soon as entry would give itself or one of its
+     * ancestors more in-mempool ancestors or descendants (by count or bytes) than the limits
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const;
+    /** Add it and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /** Estimated memory usage of the pool and its indexes, in bytes */
+    size_t DynamicMemoryUsage() const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
+    /**
+     * Estimate fee rate needed to get into the next nBlocks, trying longer
+     * targets when there is too little data for nBlocks. pnAnswerFoundAt,
+     * if given, receives the target the estimate is for (0 if none).
+     */
+    CFeeRate estimateSmartFee(int nBlocks, int* pnAnswerFoundAt = NULL) const;
+
     /** Estimate priority needed to get into the next nBlocks */
     double estimatePriority(int nBlocks) const;
 
@@ -117,6 +117,28 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     return true;
 }
 
+bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey, CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    if (IsCrypted()) {
+        std::vector<unsigned char> vchCryptedSecret;
+        if (!EncryptKey(secret, pubkey, vchCryptedSecret) ||
+            !AddCryptedKey(pubkey, vchCryptedSecret, walletdb))
+            return false;
+    } else if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey)) {
+        return false;
+    }
+
+    // check if we need to remove from watch-only
+    CScript script = GetScriptForDestination(pubkey.GetID());
+    if (HaveWatchOnly(script))
+        RemoveWatchOnly(script);
+
+    if (!IsCrypted())
+        return walletdb.WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+    return true;
+}
+
 bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
     const vector<unsigned char>& vchCryptedSecret)
 {
@@ -136,6 +158,14 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
     return false;
 }
 
+bool CWallet::AddCryptedKey(const CPubKey& vchPubKey, const vector<unsigned char>& vchCryptedSecret, CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    return walletdb.WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+}
+
 bool CWallet::LoadKeyMetadata(const CPubKey& pubkey, const CKeyMetadata& meta)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -155,6 +185,9 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    fWalletUTXOStale = true;
+    fStakeSetStale = true;
+    fAddressCoinsStale = true;
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -179,6 +212,9 @@ bool CWallet::AddWatchOnly(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    fWalletUTXOStale = true;
+    fStakeSetStale = true;
+    fAddressCoinsStale = true;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -209,6 +245,9 @@ bool CWallet::AddMultiSig(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddMultiSig(dest))
         return false;
+    fWalletUTXOStale = true;
+    fStakeSetStale = true;
+    fAddressCoinsStale = true;
     nTimeFirstKey = 1; // No birthday information
     NotifyMultiSigChanged(true);
     if (!fFileBacked)
@@ -419,6 +458,49 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     return false;
 }
 
+bool CWallet::IsSpentIrreversibly(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(false) > Params().MaxReorganizationDepth())
+            return true;
+    }
+    return false;
+}
+
+void CWallet::AddToWalletUTXO(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (fWalletUTXOStale)
+        return;
+
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) != ISMINE_NO)
+            setWalletUTXO.insert(COutPoint(hash, i));
+    }
+}
+
+void CWallet::RebuildWalletUTXO() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    setWalletUTXO.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        const CWalletTx& wtx = it->second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            COutPoint outpoint(it->first, i);
+            if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentIrreversibly(outpoint))
+                setWalletUTXO.insert(outpoint);
+        }
+    }
+    fWalletUTXOStale = false;
+    LogPrint("wallet", "%s : %u of %u wallet transactions' outputs indexed\n", __func__, setWalletUTXO.size(), mapWallet.size());
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -439,6 +521,42 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::LoadWalletTx(const CWalletTx& wtxIn)
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+    CWalletTx& wtx = mapWallet[wtxIn.GetHash()];
+    wtx = wtxIn;
+    wtx.BindWallet(this);
+}
+
+/**
+ * Index the spends of every wallet transaction at once and sync metadata only for
+ * outpoints with more than one spender, instead of per transaction as they're added.
+ */
+void CWallet::RebuildSpends()
+{
+    AssertLockHeld(cs_wallet); // mapWallet, mapTxSpends
+    mapTxSpends.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        if (it->second.IsCoinBase()) // Coinbases don't spend anything!
+            continue;
+        for (const CTxIn& txin : it->second.vin)
+            mapTxSpends.insert(make_pair(txin.prevout, it->first));
+    }
+
+    TxSpends::iterator it = mapTxSpends.begin();
+    while (it != mapTxSpends.end()) {
+        pair<TxSpends::iterator, TxSpends::iterator> range = mapTxSpends.equal_range(it->first);
+        if (std::next(range.first) != range.second)
+            SyncMetaData(range);
+        it = range.second;
+    }
+    fWalletUTXOStale = true;
+    fStakeSetStale = true;
+    fAddressCoinsStale = true;
+    MarkBalancesDirty();
+}
+
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
 {
     // wait for reindex and/or import to finish
@@ -601,27 +719,93 @@ int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    CAccountingEntry entry = acentry;
+    if (!walletdb.WriteAccountingEntry(entry))
+        return false;
+    AddAccountingEntry(entry);
+    return true;
+}
+
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    AssertLockHeld(cs_wallet); // wtxOrdered
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+void CWallet::IndexTxHeight(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet); // mapTxHeight
+    int nHeight = TX_HEIGHT_UNCONFIRMED;
+    if (wtx.hashBlock != 0) {
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && mi->second && chainActive.Contains(mi->second))
+            nHeight = mi->second->nHeight;
+    }
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+    const uint256 hash = wtx.GetHash();
+    std::map<uint256, int>::iterator it = mapTxHeight.find(hash);
+    if (it != mapTxHeight.end()) {
+        if (it->second == nHeight)
+            return;
+        setTxByHeight.erase(make_pair(it->second, hash));
+        it->second = nHeight;
+    } else {
+        mapTxHeight.insert(make_pair(hash, nHeight));
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    for (CAccountingEntry& entry : acentries) {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    setTxByHeight.insert(make_pair(nHeight, hash));
+}
+
+void CWallet::UnindexTx(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet); // wtxOrdered, mapTxHeight
+    std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end()) {
+        const CWalletTx* pwtx = &mi->second;
+        std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it) {
+            if (it->second.first == pwtx) {
+                wtxOrdered.erase(it);
+                break;
+            }
+        }
     }
 
-    return txOrdered;
+    std::map<uint256, int>::iterator it = mapTxHeight.find(hash);
+    if (it != mapTxHeight.end()) {
+        setTxByHeight.erase(make_pair(it->second, hash));
+        mapTxHeight.erase(it);
+    }
+}
+
+void CWallet::RebuildTxIndexes()
+{
+    LOCK2(cs_main, cs_wallet);
+    wtxOrdered.clear();
+    mapTxHeight.clear();
+    setTxByHeight.clear();
+    for (std::map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        CWalletTx* wtx = &((*it).second);
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        IndexTxHeight(*wtx);
+    }
+    for (CAccountingEntry& entry : laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::GetTransactionsSinceHeight(int nHeight, std::vector<const CWalletTx*>& vwtx) const
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+    vwtx.clear();
+    std::set<std::pair<int, uint256> >::const_iterator it = setTxByHeight.lower_bound(make_pair(nHeight + 1, uint256(0)));
+    for (; it != setTxByHeight.end(); ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->second);
+        if (mi != mapWallet.end())
+            vwtx.push_back(&mi->second);
+    }
 }
 
 void CWallet::MarkDirty()
@@ -630,7 +814,11 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         for (PAIRTYPE(const uint256, CWalletTx) & item : mapWallet)
             item.second.MarkDirty();
+        fWalletUTXOStale = true;
+        fStakeSetStale = true;
+        fAddressCoinsStale = true;
     }
+    MarkBalancesDirty();
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
@@ -641,6 +829,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        AddToWalletUTXO(mapWallet[hash]);
+        // wtxOrdered and the height index are built once the whole wallet is loaded
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -652,6 +842,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             if (!wtx.nTimeReceived)
                 wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
 /*
             wtx.nTimeSmart = wtx.nTimeReceived;
@@ -662,9 +853,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
+                        const TxItems& txOrdered = wtxOrdered;
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
                             CWalletTx* const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
                                 continue;
@@ -728,6 +918,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        AddToWalletUTXO(wtx);
+        IndexTxHeight(wtx);
+        QueueCoinRecheck(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -739,6 +932,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
             boost::thread t(runCommand, strCmd); // thread runs free
         }
+
+        MarkBalancesDirty(wtx);
     }
     return true;
 }
@@ -786,8 +981,15 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        UnindexTx(hash);
+        fStakeSetStale = true;
+        fAddressCoinsStale = true;
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            MarkBalancesDirty(it->second);
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1098,12 +1300,86 @@ bool CWalletTx::WriteToDisk()
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
+/** A block read by the rescan workers, with the transactions that pay to one of our scripts marked */
+struct CRescanBlock {
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CBlock block;
+    bool fRead;
+    std::vector<bool> vPaysToMe;
+};
+
+static const unsigned int RESCAN_BATCH_SIZE = 128;
+static const unsigned int MAX_RESCAN_THREADS = 8;
+
+static void ThreadRescanReadBlocks(const CWallet* pwallet, std::vector<CRescanBlock>* pvBlocks, std::atomic<unsigned int>* pnNext)
+{
+    unsigned int n;
+    while ((n = (*pnNext)++) < pvBlocks->size()) {
+        CRescanBlock& item = (*pvBlocks)[n];
+        item.fRead = ReadBlockFromDisk(item.block, item.pos) && item.block.GetHash() == item.pindex->GetBlockHash();
+        if (!item.fRead) {
+            item.block.SetNull();
+            continue;
+        }
+        item.vPaysToMe.resize(item.block.vtx.size());
+        for (unsigned int i = 0; i < item.block.vtx.size(); i++) {
+            for (const CTxOut& txout : item.block.vtx[i].vout) {
+                if (pwallet->IsMine(txout) != ISMINE_NO) {
+                    item.vPaysToMe[i] = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void StartRescanWorkers(const CWallet* pwallet, std::vector<CRescanBlock>& vBlocks, std::atomic<unsigned int>& nNext, unsigned int nThreads, boost::thread_group& workers)
+{
+    nNext = 0;
+    for (unsigned int i = 0; i < nThreads && i < vBlocks.size(); i++)
+        workers.create_thread(boost::bind(&ThreadRescanReadBlocks, pwallet, &vBlocks, &nNext));
+}
+
+/** Collect up to RESCAN_BATCH_SIZE blocks of the active chain starting at pindex */
+static void CollectRescanBatch(CBlockIndex* pindex, std::vector<CRescanBlock>& vBlocks)
+{
+    AssertLockHeld(cs_main);
+    vBlocks.clear();
+    while (pindex && vBlocks.size() < RESCAN_BATCH_SIZE) {
+        CRescanBlock item;
+        item.pindex = pindex;
+        item.pos = pindex->GetBlockPos();
+        item.fRead = false;
+        vBlocks.push_back(item);
+        pindex = chainActive.Next(pindex);
+    }
+}
+
+/**
+ * Scan the active chain from pindexStart for transactions of ours. Blocks are read and checked
+ * against the keystore in batches on worker threads, while the previous batch is applied to the
+ * wallet in chain order. cs_main and cs_wallet are only held to collect and apply a batch.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    // one rescan at a time, they would share the progress counters; a caller
+    // arriving during a scan waits for it and then scans for its own data
+    boost::lock_guard<boost::mutex> lockScanning(mutScanning);
+    fScanningWallet = true;
+    struct CScanningReset {
+        std::atomic<bool>& fScanning;
+        ~CScanningReset() { fScanning = false; }
+    } resetScanning = {fScanningWallet};
+
     int ret = 0;
     int64_t nNow = GetTime();
+    int64_t nStartTime = GetTimeMillis();
+    unsigned int nThreads = std::max(1u, std::min(MAX_RESCAN_THREADS, boost::thread::hardware_concurrency()));
 
     CBlockIndex* pindex = pindexStart;
+    std::vector<CRescanBlock> vCurrent, vNext;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1113,29 +1389,93 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            for (CTransaction& tx : block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        nScanStartHeight = pindex ? pindex->nHeight : 0;
+        nScanHeight = nScanStartHeight.load();
+        nScanTipHeight = chainActive.Height();
+        nScanStartTime = nStartTime;
+
+        CollectRescanBatch(pindex, vCurrent);
+    }
+
+    std::atomic<unsigned int> nNextRead(0);
+    {
+        boost::thread_group workers;
+        StartRescanWorkers(this, vCurrent, nNextRead, nThreads, workers);
+        workers.join_all();
+    }
+
+    int nBlocks = 0;
+    while (!vCurrent.empty()) {
+        // start reading the next batch while this one is applied
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindexLast = vCurrent.back().pindex;
+            CollectRescanBatch(chainActive.Contains(pindexLast) ? chainActive.Next(pindexLast) : NULL, vNext);
+        }
+        boost::thread_group workers;
+        StartRescanWorkers(this, vNext, nNextRead, nThreads, workers);
+
+        CBlockIndex* pindexResume = NULL;
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (CRescanBlock& item : vCurrent) {
+                if (!chainActive.Contains(item.pindex)) {
+                    // reorganized while scanning, continue from the fork
+                    const CBlockIndex* pindexFork = chainActive.FindFork(item.pindex);
+                    pindexResume = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis();
+                    break;
+                }
+                if (item.pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(item.pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                if (!item.fRead)
+                    LogPrintf("%s : failed to read block %d\n", __func__, item.pindex->nHeight);
+                for (unsigned int i = 0; i < item.block.vtx.size(); i++) {
+                    const CTransaction& tx = item.block.vtx[i];
+                    bool fCandidate = item.vPaysToMe[i] || mapWallet.count(tx.GetHash());
+                    for (unsigned int j = 0; !fCandidate && j < tx.vin.size(); j++)
+                        fCandidate = mapWallet.count(tx.vin[j].prevout.hash);
+                    if (fCandidate && AddToWalletIfInvolvingMe(tx, &item.block, fUpdate))
+                        ret++;
+                }
+                nScanHeight = item.pindex->nHeight;
+                nBlocks++;
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+            nScanTipHeight = chainActive.Height();
+        }
+
+        workers.join_all();
+        if (pindexResume) {
+            {
+                LOCK(cs_main);
+                CollectRescanBatch(pindexResume, vNext);
             }
+            StartRescanWorkers(this, vNext, nNextRead, nThreads, workers);
+            workers.join_all();
+        }
+        vCurrent.swap(vNext);
+
+        if (GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d of %d, %.2f blocks/s\n", nScanHeight.load(), nScanTipHeight.load(), GetRescanBlocksPerSecond());
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    LogPrintf("%s : scanned %d blocks in %dms with %u threads, %d transactions added or updated\n", __func__, nBlocks, GetTimeMillis() - nStartTime, nThreads, ret);
     return ret;
 }
 
+double CWallet::GetRescanBlocksPerSecond() const
+{
+    int64_t nElapsed = GetTimeMillis() - nScanStartTime;
+    if (nElapsed <= 0)
+        return 0.0;
+    return (double)(nScanHeight - nScanStartHeight) * 1000 / nElapsed;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
@@ -1237,57 +1577,128 @@ void CWallet::ResendWalletTransactions()
  * @{
  */
 
-CAmount CWallet::GetBalance() const
+void CWallet::MarkBalancesDirty()
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
+    LOCK(cs_balances);
+    fBalancesCached = false;
+}
 
-    return nTotal;
+void CWallet::MarkBalancesDirty(const uint256& hash)
+{
+    LOCK(cs_balances);
+    if (fBalancesCached)
+        setBalancesDirty.insert(hash);
 }
 
-CAmount CWallet::GetAnonymizableBalance() const
+void CWallet::MarkBalancesDirty(const CTransaction& tx)
 {
-    if(fLiteMode)
-        return 0;
+    LOCK(cs_balances);
+    if (!fBalancesCached)
+        return;
+    // the spent outputs of the parents and a change in conflict state move their shares too
+    setBalancesDirty.insert(tx.GetHash());
+    for (const CTxIn& txin : tx.vin)
+        setBalancesDirty.insert(txin.prevout.hash);
+}
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for(const auto& entry : mapWallet) {
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    LOCK(cs_balances);
+    fBalancesTipChanged = true;
+}
+
+void CWallet::UpdateTxBalances(const uint256& hash) const
+{
+    AssertLockHeld(cs_wallet);
+    AssertLockHeld(cs_balances);
+
+    map<uint256, CWalletBalances>::iterator mi = mapTxBalances.find(hash);
+    if (mi != mapTxBalances.end()) {
+        cachedBalances -= mi->second;
+        mapTxBalances.erase(mi);
+    }
+    setBalancesTipSensitive.erase(hash);
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
 
-            const auto& coin = entry.second;
+    const CWalletTx* pcoin = &(*it).second;
+    CWalletBalances balances;
+    bool fTrusted = pcoin->IsTrusted();
 
-            if(coin.IsTrusted())
-                nTotal += coin.GetAnonymizableCredit();
+    if (fTrusted) {
+        balances.nTrusted += pcoin->GetAvailableCredit();
+        balances.nWatchOnlyTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        if (!fLiteMode) {
+            balances.nAnonymizable += pcoin->GetAnonymizableCredit();
+            balances.nAnonymized += pcoin->GetAnonymizedCredit();
         }
     }
+    if (!IsFinalTx(*pcoin) || (!fTrusted && pcoin->GetDepthInMainChain() == 0)) {
+        balances.nUnconfirmed += pcoin->GetAvailableCredit();
+        balances.nWatchOnlyUnconfirmed += pcoin->GetAvailableWatchOnlyCredit();
+    }
+    balances.nImmature += pcoin->GetImmatureCredit();
+    balances.nWatchOnlyImmature += pcoin->GetImmatureWatchOnlyCredit();
+    if (!fLiteMode) {
+        balances.nDenominatedConfirmed += pcoin->GetDenominatedCredit(false);
+        balances.nDenominatedUnconfirmed += pcoin->GetDenominatedCredit(true);
+    }
 
-    return nTotal;
+    cachedBalances += balances;
+    mapTxBalances.insert(make_pair(hash, balances));
+    if (!IsFinalTx(*pcoin) || pcoin->GetDepthInMainChain(false) < 1 || pcoin->GetBlocksToMaturity() > 0)
+        setBalancesTipSensitive.insert(hash);
 }
 
-CAmount CWallet::GetAnonymizedBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    if (fLiteMode) return 0;
-
-    CAmount nTotal = 0;
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK(cs_balances);
+        if (fBalancesCached && !fBalancesTipChanged && setBalancesDirty.empty())
+            return cachedBalances;
+    }
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
+    LOCK2(cs_main, cs_wallet);
+    LOCK(cs_balances);
+    if (!fBalancesCached) {
+        cachedBalances = CWalletBalances();
+        mapTxBalances.clear();
+        setBalancesTipSensitive.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateTxBalances(it->first);
+    } else {
+        std::set<uint256> setDirty;
+        setDirty.swap(setBalancesDirty);
+        if (fBalancesTipChanged)
+            setDirty.insert(setBalancesTipSensitive.begin(), setBalancesTipSensitive.end());
+        for (const uint256& hash : setDirty)
+            UpdateTxBalances(hash);
     }
+    setBalancesDirty.clear();
+    fBalancesCached = true;
+    fBalancesTipChanged = false;
+    return cachedBalances;
+}
 
-    return nTotal;
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
+}
+
+CAmount CWallet::GetAnonymizableBalance() const
+{
+    if (fLiteMode) return 0;
+
+    return GetBalances().nAnonymizable;
+}
+
+CAmount CWallet::GetAnonymizedBalance() const
+{
+    if (fLiteMode) return 0;
+
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1357,86 +1768,33 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    CWalletBalances balances = GetBalances();
+    return unconfirmed ? balances.nDenominatedUnconfirmed : balances.nDenominatedConfirmed;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyImmature;
 }
 
 /**
@@ -1448,68 +1806,86 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
+        if (fWalletUTXOStale)
+            RebuildWalletUTXO();
+
+        const CWalletTx* pcoin = NULL;
+        bool fSkipTx = true;
+        int nDepth = 0;
+        std::set<COutPoint>::iterator it = setWalletUTXO.begin();
+        while (it != setWalletUTXO.end()) {
+            const COutPoint outpoint = *it;
+            const uint256& wtxid = outpoint.hash;
+            const unsigned int i = outpoint.n;
+
+            // outputs are ordered by tx, so the per-tx checks run once per transaction
+            if (pcoin == NULL || pcoin->GetHash() != wtxid) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+                if (mi == mapWallet.end()) {
+                    setWalletUTXO.erase(it++);
+                    continue;
+                }
+                pcoin = &(*mi).second;
+                fSkipTx = !CheckFinalTx(*pcoin) ||
+                          (fOnlyConfirmed && !pcoin->IsTrusted()) ||
+                          ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0);
+                if (!fSkipTx) {
+                    nDepth = pcoin->GetDepthInMainChain(false);
+                    // do not use IX for inputs that have less then 6 blockchain confirmations
+                    // We should not consider coins which aren't at least in our mempool
+                    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+                    fSkipTx = (fUseIX && nDepth < 6) || (nDepth == 0 && !pcoin->InMempool());
+                }
+            }
+            if (fSkipTx || i >= pcoin->vout.size()) {
+                ++it;
                 continue;
+            }
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
+            if (IsSpent(wtxid, i)) {
+                if (IsSpentIrreversibly(outpoint))
+                    setWalletUTXO.erase(it++);
+                else
+                    ++it;
                 continue;
+            }
+            ++it;
+
+            bool found = false;
+            if (nCoinType == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(pcoin->vout[i].nValue);
+            } else if (nCoinType == ONLY_NOTDEPOSITIFMN) {
+                found = !(fMasterNode && CMasternode::IsDepositCoins(pcoin->vout[i].nValue));
+            } else if (nCoinType == ONLY_NONDENOMINATED_NOTDEPOSITIFMN) {
+                if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
+                found = !IsDenominatedAmount(pcoin->vout[i].nValue);
+                if (found && fMasterNode) found = !CMasternode::IsDepositCoins(pcoin->vout[i].nValue); // do not use Hot MN funds
+            } else if (nCoinType == ONLY_DEPOSIT) {
+                found = CMasternode::IsDepositCoins(pcoin->vout[i].nValue);
+            } else {
+                found = true;
+            }
+            if (!found) continue;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+            isminetype mine = IsMine(pcoin->vout[i]);
+            if (mine == ISMINE_NO)
                 continue;
-
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
+            if (mine == ISMINE_WATCH_ONLY)
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+            if (IsLockedCoin(wtxid, i) && nCoinType != ONLY_DEPOSIT)
+                continue;
+            if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
+                continue;
+            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(wtxid, i))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOTDEPOSITIFMN) {
-                    found = !(fMasterNode && CMasternode::IsDepositCoins(pcoin->vout[i].nValue));
-                } else if (nCoinType == ONLY_NONDENOMINATED_NOTDEPOSITIFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = !CMasternode::IsDepositCoins(pcoin->vout[i].nValue); // do not use Hot MN funds
-                } else if (nCoinType == ONLY_DEPOSIT) {
-                    found = CMasternode::IsDepositCoins(pcoin->vout[i].nValue);
-                } else {
-                    found = true;
-                }
-                if (!found) continue;
-
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (IsSpent(wtxid, i))
-                    continue;
-                if (mine == ISMINE_NO)
-                    continue;
-                if (mine == ISMINE_WATCH_ONLY)
-                    continue;
-
-                if (IsLockedCoin((*it).first, i) && nCoinType != ONLY_DEPOSIT)
-                    continue;
-                if (pcoin->vout[i].nValue <= 0 && !fIncludeZeroValue)
-                    continue;
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
-                    continue;
-
-                bool fIsSpendable = false;
-                if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
-                    fIsSpendable = true;
-                if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
-                    fIsSpendable = true;
-                vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
-            }
+            bool fIsSpendable = false;
+            if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
+                fIsSpendable = true;
+            if ((mine & ISMINE_MULTISIG) != ISMINE_NO)
+                fIsSpendable = true;
+            vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
         }
     }
 }
@@ -1534,41 +1910,58 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+/**
+ * Find the subset of vValue (sorted by descending value) with the smallest total that reaches
+ * nTargetValue. Depth-first branch and bound: larger coins are tried first, branches that can't
+ * reach the target or can't beat the best total so far are cut, and including a coin equal to one
+ * just left out is skipped. The search stops at an exact match or after nMaxTries steps and keeps
+ * the best subset found; with no subset found, all coins are selected.
+ */
+static void SelectBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int nMaxTries = 100000)
 {
-    vector<char> vfIncluded;
-
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++) {
-            for (unsigned int i = 0; i < vValue.size(); i++) {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand() & 1 : !vfIncluded[i]) {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue) {
-                        fReachedTarget = true;
-                        if (nTotal < nBest) {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
+    // vRemaining[i] is the total of vValue[i..], vNextValue[i] the first index after the run of coins equal to vValue[i]
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    vector<size_t> vNextValue(vValue.size(), vValue.size());
+    for (size_t i = vValue.size(); i > 0; i--) {
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+        if (i < vValue.size())
+            vNextValue[i - 1] = vValue[i - 1].first == vValue[i].first ? vNextValue[i] : i;
+    }
+
+    vector<char> vfIncluded(vValue.size(), false);
+    vector<size_t> vIncluded;
+    CAmount nTotal = 0;
+    size_t i = 0;
+    for (int nTries = 0; nTries < nMaxTries && nBest != nTargetValue; nTries++) {
+        bool fBacktrack = false;
+        if (nTotal >= nTargetValue) {
+            if (nTotal < nBest) {
+                nBest = nTotal;
+                vfBest = vfIncluded;
             }
+            fBacktrack = true;
+        } else if (i == vValue.size() || nTotal + vRemaining[i] < nTargetValue) {
+            fBacktrack = true;
+        } else if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first) {
+            i = vNextValue[i];
+        } else {
+            nTotal += vValue[i].first;
+            vfIncluded[i] = true;
+            vIncluded.push_back(i++);
+        }
+
+        if (fBacktrack) {
+            // leave out the last coin included and try the branch without it
+            if (vIncluded.empty())
+                break;
+            i = vIncluded.back();
+            vIncluded.pop_back();
+            nTotal -= vValue[i].first;
+            vfIncluded[i] = false;
+            i++;
         }
     }
 }
@@ -1591,64 +1984,211 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
-bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const
+void CWallet::QueueCoinRecheck(const CWalletTx& wtx)
 {
-    //LOCK(cs_main);
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    AssertLockHeld(cs_wallet); // setStakeRecheck, setAddressRecheck
+    if (fStakeSetStale && fAddressCoinsStale)
+        return;
+
+    std::vector<COutPoint> vOutpoints;
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        vOutpoints.push_back(COutPoint(hash, i));
+    if (!wtx.IsCoinBase()) {
+        for (const CTxIn& txin : wtx.vin) {
+            if (mapWallet.count(txin.prevout.hash))
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+    if (!fStakeSetStale)
+        setStakeRecheck.insert(vOutpoints.begin(), vOutpoints.end());
+    if (!fAddressCoinsStale)
+        setAddressRecheck.insert(vOutpoints.begin(), vOutpoints.end());
+}
+
+/** Put outpoint in the stake set, in the queue it's waiting in, or drop it if it can't stake */
+void CWallet::CheckStakeCoin(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    setStakeCoins.erase(outpoint);
+    mapStakeWaiting.erase(outpoint);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+    if (outpoint.n >= wtx.vout.size() || wtx.vout[outpoint.n].nValue <= 0)
+        return;
+    isminetype mine = IsMine(wtx.vout[outpoint.n]);
+    if (mine == ISMINE_NO || mine == ISMINE_WATCH_ONLY)
+        return;
+    if (!CheckFinalTx(wtx) || IsLockedCoin(outpoint.hash, outpoint.n) || IsSpent(outpoint.hash, outpoint.n))
+        return;
+
+    // Unconfirmed coins come back through AddToWallet once they are in a block
+    const CBlockIndex* pindex = NULL;
+    int nDepth = wtx.GetDepthInMainChain(pindex, false);
+    if (nDepth < 1 || !pindex)
+        return;
+
+    int nMinDepth = (wtx.IsCoinBase() || wtx.IsCoinStake()) ? Params().COINBASE_MATURITY() + 1 : 10;
+    if (nDepth < nMinDepth) {
+        int64_t nHeight = pindex->nHeight + nMinDepth - 1;
+        mapStakeHeightQueue.insert(make_pair(nHeight, outpoint));
+        mapStakeWaiting[outpoint] = make_pair(true, nHeight);
+        return;
+    }
+
+    int64_t nTime = wtx.GetTxTime() + nHashDrift + nStakeMinAge;
+    if (nTime > GetAdjustedTime()) {
+        mapStakeTimeQueue.insert(make_pair(nTime, outpoint));
+        mapStakeWaiting[outpoint] = make_pair(false, nTime);
+        return;
+    }
+
+    setStakeCoins.insert(outpoint);
+}
+
+void CWallet::UpdateStakeSet()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fStakeSetStale) {
+        setStakeCoins.clear();
+        mapStakeTimeQueue.clear();
+        mapStakeHeightQueue.clear();
+        mapStakeWaiting.clear();
+        setStakeRecheck.clear();
+        if (fWalletUTXOStale)
+            RebuildWalletUTXO();
+        for (const COutPoint& outpoint : setWalletUTXO)
+            CheckStakeCoin(outpoint);
+        fStakeSetStale = false;
+        LogPrint("staking", "%s : rebuilt, %u coins can stake, %u waiting\n", __func__, setStakeCoins.size(), mapStakeWaiting.size());
+        return;
+    }
+
+    std::vector<COutPoint> vRecheck(setStakeRecheck.begin(), setStakeRecheck.end());
+    setStakeRecheck.clear();
+
+    // Collect the queue entries that came due; entries that no longer match mapStakeWaiting are stale
+    int64_t nNow = GetAdjustedTime();
+    while (!mapStakeTimeQueue.empty() && mapStakeTimeQueue.begin()->first <= nNow) {
+        std::map<COutPoint, std::pair<bool, int64_t> >::iterator it = mapStakeWaiting.find(mapStakeTimeQueue.begin()->second);
+        if (it != mapStakeWaiting.end() && it->second == make_pair(false, mapStakeTimeQueue.begin()->first))
+            vRecheck.push_back(it->first);
+        mapStakeTimeQueue.erase(mapStakeTimeQueue.begin());
+    }
+    int64_t nHeight = chainActive.Height();
+    while (!mapStakeHeightQueue.empty() && mapStakeHeightQueue.begin()->first <= nHeight) {
+        std::map<COutPoint, std::pair<bool, int64_t> >::iterator it = mapStakeWaiting.find(mapStakeHeightQueue.begin()->second);
+        if (it != mapStakeWaiting.end() && it->second == make_pair(true, mapStakeHeightQueue.begin()->first))
+            vRecheck.push_back(it->first);
+        mapStakeHeightQueue.erase(mapStakeHeightQueue.begin());
+    }
+
+    for (const COutPoint& outpoint : vRecheck)
+        CheckStakeCoin(outpoint);
+}
+
+/** Put outpoint in the address index if it is a confirmed, unspent, unlocked spendable coin of ours */
+void CWallet::CheckAddressCoin(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::map<COutPoint, std::pair<CBitcoinAddress, CAmount> >::iterator it = mapCoinAddress.find(outpoint);
+    if (it != mapCoinAddress.end()) {
+        std::map<CBitcoinAddress, std::set<std::pair<CAmount, COutPoint> > >::iterator mi = mapAddressCoins.find(it->second.first);
+        mi->second.erase(make_pair(it->second.second, outpoint));
+        if (mi->second.empty())
+            mapAddressCoins.erase(mi);
+        mapCoinAddress.erase(it);
+    }
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+    if (outpoint.n >= wtx.vout.size() || wtx.vout[outpoint.n].nValue <= 0)
+        return;
+    if ((IsMine(wtx.vout[outpoint.n]) & (ISMINE_SPENDABLE | ISMINE_MULTISIG)) == ISMINE_NO)
+        return;
+    if (!CheckFinalTx(wtx) || IsLockedCoin(outpoint.hash, outpoint.n) || IsSpent(outpoint.hash, outpoint.n))
+        return;
+    if (wtx.GetDepthInMainChain(false) < 1)
+        return;
+
+    CTxDestination address;
+    if (!ExtractDestination(wtx.vout[outpoint.n].scriptPubKey, address))
+        return;
+
+    CAmount nValue = wtx.vout[outpoint.n].nValue;
+    mapAddressCoins[CBitcoinAddress(address)].insert(make_pair(nValue, outpoint));
+    mapCoinAddress.insert(make_pair(outpoint, make_pair(CBitcoinAddress(address), nValue)));
+}
+
+void CWallet::UpdateAddressCoins()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (fAddressCoinsStale) {
+        mapAddressCoins.clear();
+        mapCoinAddress.clear();
+        setAddressRecheck.clear();
+        if (fWalletUTXOStale)
+            RebuildWalletUTXO();
+        for (const COutPoint& outpoint : setWalletUTXO)
+            CheckAddressCoin(outpoint);
+        fAddressCoinsStale = false;
+        LogPrint("wallet", "%s : rebuilt, %u coins on %u addresses\n", __func__, mapCoinAddress.size(), mapAddressCoins.size());
+        return;
+    }
+
+    for (const COutPoint& outpoint : setAddressRecheck)
+        CheckAddressCoin(outpoint);
+    setAddressRecheck.clear();
+}
+
+bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount)
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateStakeSet();
+
     CAmount nAmountSelected = 0;
+    for (const COutPoint& outpoint : setStakeCoins) {
+        const CWalletTx* pcoin = &mapWallet[outpoint.hash];
+        CAmount nValue = pcoin->vout[outpoint.n].nValue;
 
-    for (const COutput& out : vCoins) {
         //make sure not to outrun target amount
-        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+        if (nAmountSelected + nValue > nTargetAmount)
             continue;
 
-        int64_t nTxTime = out.tx->GetTxTime();
-
         //check for min input size
-        if (ActiveProtocol() >= CONSENSUS_FORK_PROTO && out.tx->vout[out.i].nValue < Params().StakeInputMin())
-            continue;
-
-        //check for min age
-        if (GetAdjustedTime() - nTxTime - nHashDrift < nStakeMinAge)
+        if (ActiveProtocol() >= CONSENSUS_FORK_PROTO && nValue < Params().StakeInputMin())
             continue;
 
-        //check that it is matured
-        if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+        //check for min age, nHashDrift may have changed since the coin was queued
+        if (GetAdjustedTime() - pcoin->GetTxTime() - nHashDrift < nStakeMinAge)
             continue;
 
         //add to our stake set
-        setCoins.insert(make_pair(out.tx, out.i));
-        nAmountSelected += out.tx->vout[out.i].nValue;
+        setCoins.insert(make_pair(pcoin, outpoint.n));
+        nAmountSelected += nValue;
     }
     return true;
 }
 
 bool CWallet::MintableCoins()
 {
-    //LOCK(cs_main);
     CAmount nBalance = GetBalance();
     if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
         return error("MintableCoins() : invalid reserve balance amount");
     if (nBalance <= nReserveBalance)
         return false;
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
-
-    for (const COutput& out : vCoins) {
-        int64_t nTxTime = out.tx->GetTxTime();
-
-        if (ActiveProtocol() >= CONSENSUS_FORK_PROTO){
-            if (out.tx->vout[out.i].nValue >= Params().StakeInputMin() && GetAdjustedTime() - nTxTime > nStakeMinAge)
-                return true;
-        } else {
-            if (GetAdjustedTime() - nTxTime > nStakeMinAge)
-                return true;
-        }
-    }
-
-    return false;
+    std::set<std::pair<const CWalletTx*, unsigned int> > setCoins;
+    return SelectStakeCoins(setCoins, nBalance - nReserveBalance) && !setCoins.empty();
 }
 
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
@@ -1728,16 +2268,17 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         break;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Solve subset sum by branch and bound. The sort is stable so coins of equal value
+    // keep their shuffled order and the choice between them stays random.
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    SelectBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        SelectBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest);
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    // If we have a bigger coin and (either the subset search didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
         ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest)) {
@@ -2354,17 +2895,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    // presstab HyperStake - Initialize as static and don't update the set on every run of CreateCoinStake() in order to lighten resource use
-    static std::set<pair<const CWalletTx*, unsigned int> > setStakeCoins;
-    static int nLastStakeSetUpdate = 0;
-
-    if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
-        setStakeCoins.clear();
-        if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
-            return false;
-
-        nLastStakeSetUpdate = GetTime();
-    }
+    // The stake set is kept up to date by wallet events, so selecting from it is cheap on every run
+    std::set<pair<const CWalletTx*, unsigned int> > setStakeCoins;
+    if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
+        return false;
 
     if (setStakeCoins.empty())
         return false;
@@ -2502,7 +3036,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     }
 
     // Successfully generated coinstake
-    nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
     return true;
 }
 
@@ -2565,9 +3098,9 @@ CAmount CWallet::GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarge
     // user selected total at least (default=true)
     if (fPayAtLeastCustomFee && nFeeNeeded > 0 && nFeeNeeded < payTxFee.GetFeePerK())
         nFeeNeeded = payTxFee.GetFeePerK();
-    // User didn't set: use -txconfirmtarget to estimate...
+    // User didn't set: use -txconfirmtarget to estimate, or a longer target if there is too little data...
     if (nFeeNeeded == 0)
-        nFeeNeeded = pool.estimateFee(nConfirmTarget).GetFee(nTxBytes);
+        nFeeNeeded = pool.estimateSmartFee(nConfirmTarget).GetFee(nTxBytes);
     // ... unless we don't have enough mempool data, in which case fall
     // back to a hard-coded fee
     if (nFeeNeeded == 0)
@@ -2748,6 +3281,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    RebuildTxIndexes();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2845,7 +3380,7 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
+        int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
         for (int i = 0; i < nKeys; i++) {
             int64_t nIndex = i + 1;
             walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
@@ -2856,6 +3391,61 @@ bool CWallet::NewKeyPool()
     return true;
 }
 
+/** Generate key pairs for the key pool; doesn't touch the wallet so it runs without cs_wallet */
+static void MakeKeyPoolKeys(unsigned int nKeys, std::vector<std::pair<CKey, CPubKey> >& vKeys)
+{
+    RandAddSeedPerfmon();
+    vKeys.resize(nKeys);
+    for (unsigned int i = 0; i < nKeys; i++) {
+        CKey& secret = vKeys[i].first;
+        // compressed keys are part of FEATURE_BASE, as in GenerateNewKey, so no SetMinVersion is needed
+        secret.MakeNewKey(true /* compressed */);
+        vKeys[i].second = secret.GetPubKey();
+        assert(secret.VerifyPubKey(vKeys[i].second));
+    }
+}
+
+/** Add freshly generated keys to the wallet and the key pool, writing them in one database transaction */
+bool CWallet::AddKeyPoolBatch(const std::vector<std::pair<CKey, CPubKey> >& vKeys)
+{
+    AssertLockHeld(cs_wallet); // setKeyPool
+    if (vKeys.empty())
+        return true;
+
+    int64_t nCreationTime = GetTime();
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+
+    if (!fFileBacked) {
+        for (const std::pair<CKey, CPubKey>& key : vKeys) {
+            mapKeyMetadata[key.second.GetID()] = CKeyMetadata(nCreationTime);
+            if (!AddKeyPubKey(key.first, key.second))
+                return false;
+            setKeyPool.insert(setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1);
+        }
+        return true;
+    }
+
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return false;
+    std::vector<int64_t> vIndex;
+    int64_t nEnd = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+    for (const std::pair<CKey, CPubKey>& key : vKeys) {
+        mapKeyMetadata[key.second.GetID()] = CKeyMetadata(nCreationTime);
+        if (!AddKeyPubKey(key.first, key.second, walletdb) ||
+            !walletdb.WritePool(nEnd, CKeyPool(key.second))) {
+            walletdb.TxnAbort();
+            return false;
+        }
+        vIndex.push_back(nEnd++);
+    }
+    if (!walletdb.TxnCommit())
+        return false;
+    setKeyPool.insert(vIndex.begin(), vIndex.end());
+    return true;
+}
+
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
     {
@@ -2864,24 +3454,20 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
             nTargetSize = kpSize;
         else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
 
         while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            std::vector<std::pair<CKey, CPubKey> > vKeys;
+            MakeKeyPoolKeys(std::min((size_t)KEYPOOL_BATCH_SIZE, nTargetSize + 1 - setKeyPool.size()), vKeys);
+            if (!AddKeyPoolBatch(vKeys))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+            LogPrintf("keypool added %u keys, size=%u\n", vKeys.size(), setKeyPool.size());
+            double dProgress = 100.f * setKeyPool.size() / (nTargetSize + 1);
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
@@ -2889,6 +3475,77 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
     return true;
 }
 
+/**
+ * Top the key pool up to -keypool once it has dropped to -keypoollowwater. Keys are generated
+ * without cs_wallet; the lock is only taken to add each batch.
+ */
+void CWallet::FillKeyPool()
+{
+    unsigned int nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
+    unsigned int nLowWater = std::min((unsigned int)max(GetArg("-keypoollowwater", DEFAULT_KEYPOOL_LOWWATER), (int64_t)0), nTargetSize);
+    {
+        LOCK(cs_wallet);
+        if (IsLocked() || setKeyPool.size() > nLowWater)
+            return;
+    }
+
+    unsigned int nAdded = 0;
+    while (true) {
+        boost::this_thread::interruption_point();
+        size_t nMissing;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked() || setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nMissing = nTargetSize + 1 - setKeyPool.size();
+        }
+
+        std::vector<std::pair<CKey, CPubKey> > vKeys;
+        MakeKeyPoolKeys(std::min((size_t)KEYPOOL_BATCH_SIZE, nMissing), vKeys);
+
+        LOCK(cs_wallet);
+        // the wallet may have been locked while the keys were generated
+        if (IsLocked())
+            break;
+        if (!AddKeyPoolBatch(vKeys)) {
+            LogPrintf("%s : writing generated keys failed\n", __func__);
+            break;
+        }
+        nAdded += vKeys.size();
+    }
+    if (nAdded)
+        LogPrint("keypool", "%s : added %u keys, size=%u\n", __func__, nAdded, setKeyPool.size());
+}
+
+void CWallet::RequestKeyPoolFill()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutKeyPoolFiller);
+        fKeyPoolFillRequested = true;
+    }
+    condKeyPoolFiller.notify_one();
+}
+
+void ThreadKeyPoolFiller(CWallet* pwallet)
+{
+    RenameThread("vkcoin-keypool");
+    pwallet->fKeyPoolFillerRunning = true;
+    try {
+        while (true) {
+            pwallet->FillKeyPool();
+
+            // wake up on request, or now and then to catch a wallet that was unlocked
+            boost::unique_lock<boost::mutex> lock(pwallet->mutKeyPoolFiller);
+            if (!pwallet->fKeyPoolFillRequested)
+                pwallet->condKeyPoolFiller.timed_wait(lock, boost::posix_time::seconds(10));
+            pwallet->fKeyPoolFillRequested = false;
+        }
+    } catch (boost::thread_interrupted) {
+        pwallet->fKeyPoolFillerRunning = false;
+        throw;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2896,8 +3553,13 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        if (!IsLocked()) {
+            // With the background filler only an empty pool is topped up here, by a single key
+            if (!fKeyPoolFillerRunning)
+                TopUpKeyPool();
+            else if (setKeyPool.empty())
+                TopUpKeyPool(1);
+        }
 
         // Get the oldest key
         if (setKeyPool.empty())
@@ -2914,6 +3576,8 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
         assert(keypool.vchPubKey.IsValid());
         LogPrintf("keypool reserve %d\n", nIndex);
     }
+    if (fKeyPoolFillerRunning)
+        RequestKeyPoolFill();
 }
 
 void CWallet::KeepKey(int64_t nIndex)
@@ -3157,6 +3821,7 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            MarkBalancesDirty(hashTx);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3168,18 +3833,27 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    setStakeRecheck.insert(output);
+    setAddressRecheck.insert(output);
+    MarkBalancesDirty(output.hash);
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    setStakeRecheck.insert(output);
+    setAddressRecheck.insert(output);
+    MarkBalancesDirty(output.hash);
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    fStakeSetStale = true;
+    fAddressCoinsStale = true;
+    MarkBalancesDirty();
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -3333,58 +4007,66 @@ bool CWallet::GetDestData(const CTxDestination& dest, const std::string& key, st
 
 void CWallet::AutoCombineDust()
 {
-    //LOCK2(cs_main, cs_wallet);
     if (IsInitialBlockDownload() || IsLocked()) {
         return;
     }
 
-    map<CBitcoinAddress, vector<COutput> > mapCoinsByAddress = AvailableCoinsByAddress(true, 0);
+    // Pick the coins to combine from the address index, then build each transaction on its own
+    std::vector<std::pair<CBitcoinAddress, std::vector<COutPoint> > > vCombine;
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateAddressCoins();
 
-    //coins are sectioned by address. This combination code only wants to combine inputs that belong to the same address
-    for (map<CBitcoinAddress, vector<COutput> >::iterator it = mapCoinsByAddress.begin(); it != mapCoinsByAddress.end(); it++) {
-        vector<COutput> vCoins, vRewardCoins;
-        vCoins = it->second;
+        const CAmount nThreshold = nAutoCombineThreshold * COIN;
+        //coins are sectioned by address. This combination code only wants to combine inputs that belong to the same address
+        for (const auto& item : mapAddressCoins) {
+            //we cannot combine one coin with itself, and coins are ordered by value
+            if (item.second.size() <= 1 || item.second.begin()->first > nThreshold)
+                continue;
 
-        //find masternode rewards that need to be combined
-        CCoinControl* coinControl = new CCoinControl();
-        CAmount nTotalRewardsValue = 0;
-        for (const COutput& out : vCoins) {
-            int txDepth = out.tx->GetDepthInMainChain();
+            std::vector<COutPoint> vRewardCoins;
+            CAmount nTotalRewardsValue = 0;
+            for (const std::pair<CAmount, COutPoint>& coin : item.second) {
+                if (coin.first > nThreshold)
+                    break;
 
-            //no coins should get this far if they dont have proper maturity, this is double checking
-            if (out.tx->IsCoinStake() && txDepth < Params().COINBASE_MATURITY() + 1)
-                continue;
+                const CWalletTx& wtx = mapWallet[coin.second.hash];
+                //no coins should get this far if they dont have proper maturity, this is double checking
+                if ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0)
+                    continue;
 
-            // skip inputs over autocombine confirmations limit
-            if (nAutoCombineLimit > 0 && txDepth > nAutoCombineLimit)
-                continue;
+                // skip inputs over autocombine confirmations limit
+                if (nAutoCombineLimit > 0 && wtx.GetDepthInMainChain(false) > nAutoCombineLimit)
+                    continue;
 
-            if (out.Value() > nAutoCombineThreshold * COIN)
+                vRewardCoins.push_back(coin.second);
+                nTotalRewardsValue += coin.first;
+                //if threshold taken stop combine inputs
+                if (nTotalRewardsValue >= nThreshold)
+                    break;
+            }
+
+            //if inputs values lower threshold return, prevent small tx spam
+            if (nTotalRewardsValue < nThreshold || vRewardCoins.size() <= 1)
                 continue;
 
-            COutPoint outpt(out.tx->GetHash(), out.i);
-            coinControl->Select(outpt);
-            vRewardCoins.push_back(out);
-            nTotalRewardsValue += out.Value();
-            //if threshold taken stop combine inputs
-            if (nTotalRewardsValue >= nAutoCombineThreshold * COIN)
-                break;
+            vCombine.push_back(make_pair(item.first, vRewardCoins));
         }
+    }
 
-        //if no inputs found then return
-        if (!coinControl->HasSelected())
-            continue;
-
-        //if inputs values lower threshold return, prevent small tx spam
-        if (nTotalRewardsValue < nAutoCombineThreshold * COIN)
-            continue;
-
-        //we cannot combine one coin with itself
-        if (vRewardCoins.size() <= 1)
-            continue;
+    for (const auto& combine : vCombine) {
+        CCoinControl coinControl;
+        CAmount nTotalRewardsValue = 0;
+        {
+            LOCK(cs_wallet);
+            for (const COutPoint& outpt : combine.second) {
+                coinControl.Select(outpt);
+                nTotalRewardsValue += mapWallet[outpt.hash].vout[outpt.n].nValue;
+            }
+        }
 
         vector<pair<CScript, CAmount> > vecSend;
-        CScript scriptPubKey = GetScriptForDestination(it->first.Get());
+        CScript scriptPubKey = GetScriptForDestination(combine.first.Get());
         vecSend.push_back(make_pair(scriptPubKey, nTotalRewardsValue));
 
         // Create the transaction and commit it to the network
@@ -3395,10 +4077,10 @@ void CWallet::AutoCombineDust()
 
         //get the fee amount
         CWalletTx wtxdummy;
-        CreateTransaction(vecSend, wtxdummy, keyChange, nFeeRet, strErr, coinControl, ALL_COINS, false, CAmount(0));
+        CreateTransaction(vecSend, wtxdummy, keyChange, nFeeRet, strErr, &coinControl, ALL_COINS, false, CAmount(0));
         vecSend[0].second = nTotalRewardsValue - nFeeRet - 1000;
 
-        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, coinControl, ALL_COINS, false, CAmount(0)/*nFeeRet*/)) {
+        if (!CreateTransaction(vecSend, wtx, keyChange, nFeeRet, strErr, &coinControl, ALL_COINS, false, CAmount(0)/*nFeeRet*/)) {
             LogPrintf("AutoCombineDust createtransaction failed, reason: %s\n", strErr);
             continue;
         }
@@ -3409,32 +4091,52 @@ void CWallet::AutoCombineDust()
         }
 
         LogPrintf("AutoCombineDust sent transaction\n");
-
-        delete coinControl;
     }
 }
 
 bool CWallet::MultiSend()
 {
-    //LOCK2(cs_main, cs_wallet);
     if (IsInitialBlockDownload() || IsLocked()) {
         return false;
     }
 
-    if (chainActive.Tip()->nHeight <= nLastMultiSendHeight) {
-        LogPrintf("Multisend: lastmultisendheight is higher than current best height\n");
-        return false;
+    std::vector<COutput> vCoins;
+    {
+        LOCK2(cs_main, cs_wallet);
+        int nHeight = chainActive.Height();
+        if (nHeight <= nLastMultiSendHeight) {
+            LogPrintf("Multisend: lastmultisendheight is higher than current best height\n");
+            return false;
+        }
+
+        // Outputs are sent when they reach precisely COINBASE_MATURITY + 1 confirmations; blocks
+        // connected since the last run are covered by taking the transactions confirmed in the
+        // matching window of heights from the wallet's height index
+        int nMaturity = Params().COINBASE_MATURITY();
+        int nFirstHeight = nHeight - nMaturity;
+        if (nMultiSendScanHeight > 0 && nMultiSendScanHeight < nHeight)
+            nFirstHeight = nMultiSendScanHeight - nMaturity + 1;
+        nMultiSendScanHeight = nHeight;
+
+        std::set<std::pair<int, uint256> >::const_iterator it = setTxByHeight.lower_bound(make_pair(nFirstHeight, uint256(0)));
+        for (; it != setTxByHeight.end() && it->first <= nHeight - nMaturity; ++it) {
+            const CWalletTx& wtx = mapWallet[it->second];
+            if (!wtx.IsCoinStake())
+                continue;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+                isminetype mine = IsMine(wtx.vout[i]);
+                if ((mine & ISMINE_SPENDABLE) == ISMINE_NO || wtx.vout[i].nValue <= 0)
+                    continue;
+                if (IsSpent(it->second, i) || IsLockedCoin(it->second, i))
+                    continue;
+                vCoins.emplace_back(COutput(&wtx, i, nHeight - it->first + 1, true));
+            }
+        }
     }
 
-    std::vector<COutput> vCoins;
-    AvailableCoins(vCoins);
     int stakeSent = 0;
     int mnSent = 0;
     for (const COutput& out : vCoins) {
-        //need output with precise confirm count - this is how we identify which is the output to send
-        if (out.tx->GetDepthInMainChain() != Params().COINBASE_MATURITY() + 1)
-            continue;
-
         COutPoint outpoint(out.tx->GetHash(), out.i);
         bool sendMSonMNReward = fMultiSendMasternodeReward && outpoint.IsMasternodeReward(out.tx);
         bool sendMSOnStake = fMultiSendStake && out.tx->IsCoinStake() && !sendMSonMNReward; //output is either mnreward or stake reward, not both
@@ -3532,6 +4234,47 @@ bool CWallet::MultiSend()
     return true;
 }
 
+void CWallet::RequestAutoSend()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutAutoSend);
+        fAutoSendRequested = true;
+    }
+    condAutoSend.notify_one();
+}
+
+void ThreadAutoSend(CWallet* pwallet)
+{
+    RenameThread("vkcoin-autosend");
+    int64_t nLastRun = 0;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(pwallet->mutAutoSend);
+            while (!pwallet->fAutoSendRequested)
+                pwallet->condAutoSend.wait(lock);
+        }
+
+        // blocks that arrive while we wait are handled by the same run
+        int64_t nWait = nLastRun + AUTOSEND_INTERVAL - GetTime();
+        if (nWait > 0)
+            MilliSleep(nWait * 1000);
+        boost::this_thread::interruption_point();
+        {
+            boost::unique_lock<boost::mutex> lock(pwallet->mutAutoSend);
+            pwallet->fAutoSendRequested = false;
+        }
+        nLastRun = GetTime();
+
+        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
+        if (pwallet->isMultiSendEnabled())
+            pwallet->MultiSend();
+
+        // If turned on Auto Combine will scan wallet for dust to combine
+        if (pwallet->fCombineDust)
+            pwallet->AutoCombineDust();
+    }
+}
+
 CKeyPool::CKeyPool()
 {
     nTime = GetTime();
@@ -3651,7 +4394,7 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!fEnableSwiftTX) return -1;
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
+    auto i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return (*i).second.CountSignatures();
     }
@@ -3664,7 +4407,7 @@ bool CMerkleTx::IsTransactionLockTimedOut() const
     if (!fEnableSwiftTX) return 0;
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
+    auto i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return GetTime() > (*i).second.nTimeout;
     }
@@ -27,6 +27,9 @@
 #include "masternode.h"
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <list>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -55,6 +58,14 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! -keypool default
+static const unsigned int DEFAULT_KEYPOOL_SIZE = 100;
+//! -keypoollowwater default: the background filler tops the key pool up once it drops to this size
+static const unsigned int DEFAULT_KEYPOOL_LOWWATER = 50;
+//! Keys generated and written to the key pool under one database transaction
+static const unsigned int KEYPOOL_BATCH_SIZE = 100;
+//! Minimum number of seconds between two MultiSend/auto-combine runs of ThreadAutoSend
+static const int64_t AUTOSEND_INTERVAL = 30;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -89,6 +100,57 @@ struct CompactTallyItem {
     }
 };
 
+/** Wallet balance buckets, all computed in the same pass over mapWallet */
+struct CWalletBalances {
+    CAmount nTrusted;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUnconfirmed;
+    CAmount nWatchOnlyImmature;
+    CAmount nAnonymizable;
+    CAmount nAnonymized;
+    CAmount nDenominatedConfirmed;
+    CAmount nDenominatedUnconfirmed;
+    CWalletBalances()
+    {
+        nTrusted = nUnconfirmed = nImmature = 0;
+        nWatchOnlyTrusted = nWatchOnlyUnconfirmed = nWatchOnlyImmature = 0;
+        nAnonymizable = nAnonymized = 0;
+        nDenominatedConfirmed = nDenominatedUnconfirmed = 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nTrusted += b.nTrusted;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nWatchOnlyTrusted += b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed += b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature += b.nWatchOnlyImmature;
+        nAnonymizable += b.nAnonymizable;
+        nAnonymized += b.nAnonymized;
+        nDenominatedConfirmed += b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed += b.nDenominatedUnconfirmed;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nWatchOnlyTrusted -= b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed -= b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature -= b.nWatchOnlyImmature;
+        nAnonymizable -= b.nAnonymizable;
+        nAnonymized -= b.nAnonymized;
+        nDenominatedConfirmed -= b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed -= b.nDenominatedUnconfirmed;
+        return *this;
+    }
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -160,9 +222,97 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs of ours that are not known to be irrevocably spent. AvailableCoins walks this
+     * instead of every output in mapWallet. It is rebuilt lazily after key or script imports,
+     * and outputs whose spend is deeper than the reorganization limit are dropped as they're seen.
+     */
+    mutable std::set<COutPoint> setWalletUTXO;
+    mutable bool fWalletUTXOStale;
+    void AddToWalletUTXO(const CWalletTx& wtx);
+    void RebuildWalletUTXO() const;
+    bool IsSpentIrreversibly(const COutPoint& outpoint) const;
+
+    /**
+     * Staking candidates: outputs that can stake now, and outputs waiting for the stake age
+     * (by time) or for maturity (by height). Wallet changes only queue the outputs they touch
+     * in setStakeRecheck; UpdateStakeSet rechecks those and the queue entries that came due.
+     * mapStakeWaiting holds the current queue entry of each waiting output, older ones are stale.
+     */
+    std::set<COutPoint> setStakeCoins;
+    std::multimap<int64_t, COutPoint> mapStakeTimeQueue;
+    std::multimap<int64_t, COutPoint> mapStakeHeightQueue;
+    std::map<COutPoint, std::pair<bool, int64_t> > mapStakeWaiting;
+    std::set<COutPoint> setStakeRecheck;
+    bool fStakeSetStale;
+    void CheckStakeCoin(const COutPoint& outpoint);
+    void UpdateStakeSet();
+
+    /**
+     * Confirmed, unspent, unlocked spendable outputs grouped by address and ordered by value,
+     * so auto-combine finds the small coins of each address without scanning the wallet.
+     * Maintained from setAddressRecheck like the stake set; maturity is checked when planning.
+     */
+    std::map<CBitcoinAddress, std::set<std::pair<CAmount, COutPoint> > > mapAddressCoins;
+    std::map<COutPoint, std::pair<CBitcoinAddress, CAmount> > mapCoinAddress;
+    std::set<COutPoint> setAddressRecheck;
+    bool fAddressCoinsStale;
+    void CheckAddressCoin(const COutPoint& outpoint);
+    void UpdateAddressCoins();
+
+    //! Queue the outputs and spent inputs of wtx for the stake set and the address index
+    void QueueCoinRecheck(const CWalletTx& wtx);
+
+    /**
+     * Running balance totals and each wallet transaction's share of them. Only transactions
+     * marked dirty by a wallet event are recomputed; those whose share can move with the chain
+     * tip alone (unconfirmed, non-final, immature) are also recomputed after a tip update.
+     */
+    mutable CCriticalSection cs_balances;
+    mutable CWalletBalances cachedBalances;
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalancesDirty;
+    mutable std::set<uint256> setBalancesTipSensitive;
+    mutable bool fBalancesCached;
+    mutable bool fBalancesTipChanged;
+    //! Drop the whole balance cache
+    void MarkBalancesDirty();
+    //! Recompute the share of hash on the next query
+    void MarkBalancesDirty(const uint256& hash);
+    //! Recompute the share of tx and of the transactions it spends on the next query
+    void MarkBalancesDirty(const CTransaction& tx);
+    void UpdateTxBalances(const uint256& hash) const;
+
+    //! Held by a running ScanForWalletTransactions, so a second scan waits for it to finish
+    boost::mutex mutScanning;
+
+    //! Wakes ThreadKeyPoolFiller when a key is taken from the pool
+    boost::mutex mutKeyPoolFiller;
+    boost::condition_variable condKeyPoolFiller;
+    bool fKeyPoolFillRequested;
+    std::atomic<bool> fKeyPoolFillerRunning;
+    bool AddKeyPoolBatch(const std::vector<std::pair<CKey, CPubKey> >& vKeys);
+
+    //! Wakes ThreadAutoSend after a new block; nMultiSendScanHeight is the tip MultiSend last looked at
+    boost::mutex mutAutoSend;
+    boost::condition_variable condAutoSend;
+    bool fAutoSendRequested;
+    int nMultiSendScanHeight;
+
+    /**
+     * Height of the active chain block confirming each wallet transaction, or
+     * TX_HEIGHT_UNCONFIRMED if it isn't confirmed there. Kept current by AddToWallet,
+     * which SyncTransaction reaches for every transaction of a connected or disconnected block.
+     */
+    static const int TX_HEIGHT_UNCONFIRMED = std::numeric_limits<int>::max();
+    std::map<uint256, int> mapTxHeight;
+    std::set<std::pair<int, uint256> > setTxByHeight;
+    void IndexTxHeight(const CWalletTx& wtx);
+    void UnindexTx(const uint256& hash);
+
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const;
+    bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount);
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -196,7 +346,6 @@ public:
     unsigned int nHashDrift;
     unsigned int nHashInterval;
     uint64_t nStakeSplitThreshold;
-    int nStakeSetUpdateTime;
 
     //MultiSend
     std::vector<std::pair<std::string, int> > vMultiSend;
@@ -207,6 +356,14 @@ public:
     int nLastMultiSendHeight;
     std::vector<std::string> vDisabledAddresses;
 
+    //! Progress of a running ScanForWalletTransactions, readable without cs_wallet. fScanningWallet
+    //! is set while a scan runs; scans run one at a time, another caller waits for its turn.
+    std::atomic<bool> fScanningWallet;
+    std::atomic<int> nScanStartHeight;
+    std::atomic<int> nScanHeight;
+    std::atomic<int> nScanTipHeight;
+    std::atomic<int64_t> nScanStartTime;
+
     //Auto Combine Inputs
     bool fCombineDust;
     CAmount nAutoCombineThreshold;
@@ -242,12 +399,25 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fBalancesCached = false;
+        fBalancesTipChanged = false;
+        fWalletUTXOStale = true;
+        fStakeSetStale = true;
+        fAddressCoinsStale = true;
+        fKeyPoolFillRequested = false;
+        fKeyPoolFillerRunning = false;
+        fAutoSendRequested = false;
+        nMultiSendScanHeight = 0;
+        fScanningWallet = false;
+        nScanStartHeight = 0;
+        nScanHeight = 0;
+        nScanTipHeight = 0;
+        nScanStartTime = 0;
 
         // Stake Settings
         nHashDrift = 45;
         nStakeSplitThreshold = 500;
         nHashInterval = 35;
-        nStakeSetUpdateTime = 300; // 5 minutes
 
         //MultiSend
         vMultiSend.clear();
@@ -321,6 +491,8 @@ public:
 
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
+    //! Adds a key to the store, and saves it through walletdb (e.g. inside its transaction).
+    bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey, CWalletDB& walletdb);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey& pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
     //! Load metadata (used by LoadWallet)
@@ -336,6 +508,8 @@ public:
 
     //! Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret);
+    //! Adds an encrypted key to the store, and saves it through walletdb.
+    bool AddCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, CWalletDB& walletdb);
     //! Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
@@ -377,21 +551,40 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair> TxItems;
 
+    //! The wallet's activity log: all transactions and accounting entries by nOrderPos
+    TxItems wtxOrdered;
+    //! Accounting entries of all accounts, loaded with the wallet and referenced by wtxOrdered
+    std::list<CAccountingEntry> laccentries;
+
+    /** Rebuild wtxOrdered and the confirmation height index after nOrderPos was rewritten */
+    void RebuildTxIndexes();
+    /**
+     * Write an accounting entry and add it to the in-memory log. Inside a database transaction,
+     * write the entries with CWalletDB::WriteAccountingEntry and add them after TxnCommit instead.
+     */
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
+    //! Add an accounting entry already written to the wallet database to the in-memory log
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+
     /**
-     * Get the wallet's activity log
-     * @return multimap of ordered transactions and accounting entries
-     * @warning Returned pointers are *only* valid within the scope of passed acentries
+     * Get the transactions not confirmed in the active chain at or below nHeight: those in
+     * later blocks plus unconfirmed and conflicted ones
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    void GetTransactionsSinceHeight(int nHeight, std::vector<const CWalletTx*>& vwtx) const;
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
+    //! Add a transaction read from the wallet file; its spends are indexed by RebuildSpends
+    void LoadWalletTx(const CWalletTx& wtxIn);
+    void RebuildSpends();
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    double GetRescanBlocksPerSecond() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    CWalletBalances GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -421,12 +614,17 @@ public:
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime, CAmount nFees);
     bool MultiSend();
     void AutoCombineDust();
+    void RequestAutoSend();
+    friend void ThreadAutoSend(CWallet* pwallet);
 
     static CFeeRate minTxFee;
     static CAmount GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool);
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    void FillKeyPool();
+    void RequestKeyPoolFill();
+    friend void ThreadKeyPoolFiller(CWallet* pwallet);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -521,6 +719,8 @@ public:
 
     bool UpdatedTransaction(const uint256& hashTx);
 
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+
     void Inventory(const uint256& hash)
     {
         {
@@ -1355,4 +1555,10 @@ private:
     std::vector<char> _ssExtra;
 };
 
+/** Keep the key pool of pwallet topped up in the background once it drops to -keypoollowwater */
+void ThreadKeyPoolFiller(CWallet* pwallet);
+
+/** Run MultiSend and auto-combine for pwallet after new blocks, at most once per AUTOSEND_INTERVAL seconds */
+void ThreadAutoSend(CWallet* pwallet);
+
 #endif // BITCOIN_WALLET_H
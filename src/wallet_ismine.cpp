@@ -37,8 +37,24 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest)
     return IsMine(keystore, script);
 }
 
+/** Whether the script has the exact byte layout of a P2PKH, P2SH or P2PK output, the forms the keystore indexes */
+static bool IsIndexedScriptForm(const CScript& script)
+{
+    if (script.size() == 25)
+        return script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG;
+    if (script.size() == 35)
+        return script[0] == 33 && script[34] == OP_CHECKSIG;
+    if (script.size() == 67)
+        return script[0] == 65 && script[66] == OP_CHECKSIG;
+    return script.IsPayToScriptHash();
+}
+
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey)
 {
+    // the common case, a standard output that isn't ours, costs a single lookup
+    if (IsIndexedScriptForm(scriptPubKey) && !keystore.HaveScriptPubKey(scriptPubKey))
+        return ISMINE_NO;
+
     if(keystore.HaveWatchOnly(scriptPubKey))
         return ISMINE_WATCH_ONLY;
     if(keystore.HaveMultiSig(scriptPubKey))
@@ -21,6 +21,7 @@
 
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
+#include <atomic>
 #include <fstream>
 
 using namespace boost;
@@ -277,9 +278,10 @@ bool CWalletDB::WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccount
     return Write(std::make_pair(std::string("acentry"), std::make_pair(acentry.strAccount, nAccEntryNum)), acentry);
 }
 
-bool CWalletDB::WriteAccountingEntry(const CAccountingEntry& acentry)
+bool CWalletDB::WriteAccountingEntry(CAccountingEntry& acentry)
 {
-    return WriteAccountingEntry(++nAccountingEntryNumber, acentry);
+    acentry.nEntryNo = ++nAccountingEntryNumber;
+    return WriteAccountingEntry(acentry.nEntryNo, acentry);
 }
 
 CAmount CWalletDB::GetAccountCreditDebit(const string& strAccount)
@@ -350,9 +352,7 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
         CWalletTx* wtx = &((*it).second);
         txByTime.insert(make_pair(wtx->nTimeReceived, TxPair(wtx, (CAccountingEntry*)0)));
     }
-    list<CAccountingEntry> acentries;
-    ListAccountCreditDebit("", acentries);
-    for (CAccountingEntry& entry : acentries) {
+    for (CAccountingEntry& entry : pwallet->laccentries) {
         txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
     }
 
@@ -418,6 +418,88 @@ public:
     }
 };
 
+/** Decode a "tx" record. fUpgraded is set if the record was written by 0.3.16 and needs rewriting. */
+static bool ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    // context-free checks only, this runs on the loader threads without cs_main
+    if (!(CheckTransactionSanity(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
+        if (!ssValue.empty()) {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        } else {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+/** Decode and check a "key" or "wkey" record (the type has already been read from ssKey) */
+static bool ReadWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid()) {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash = 0;
+
+    if (strType == "key") {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try {
+        ssValue >> hash;
+    } catch (...) {
+    }
+
+    bool fSkipCheck = false;
+
+    if (hash != 0) {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash) {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
 bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CWalletScanState& wss, string& strType, string& strErr)
 {
     try {
@@ -435,28 +517,12 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
         } else if (strType == "tx") {
             uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!ReadWalletTx(ssKey, ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
-                if (!ssValue.empty()) {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                        wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                } else {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 wss.vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -470,12 +536,13 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             if (nNumber > nAccountingEntryNumber)
                 nAccountingEntryNumber = nNumber;
 
-            if (!wss.fAnyUnordered) {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
-            }
+            CAccountingEntry acentry;
+            ssValue >> acentry;
+            acentry.strAccount = strAccount;
+            acentry.nEntryNo = nNumber;
+            if (acentry.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+            pwallet->laccentries.push_back(acentry);
         } else if (strType == "watchs") {
             CScript script;
             ssKey >> script;
@@ -500,55 +567,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
 		pwallet->nTimeFirstKey = 1;
         } else if (strType == "key" || strType == "wkey") {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid()) {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            uint256 hash = 0;
-
-            if (strType == "key") {
+            if (strType == "key")
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try {
-                ssValue >> hash;
-            } catch (...) {
-            }
-
-            bool fSkipCheck = false;
-
-            if (hash != 0) {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash) {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!ReadWalletKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey)) {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -669,6 +692,55 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
     return true;
 }
 
+/** A wallet record kept raw while the cursor is walked; "tx", "key" and "wkey" records are decoded by a loader thread */
+struct CWalletLoadRecord {
+    std::string strType;
+    CDataStream ssKey;
+    CDataStream ssValue;
+
+    bool fDecoded;
+    std::string strErr;
+    uint256 hash;
+    CWalletTx wtx;
+    bool fUpgraded;
+    CPubKey vchPubKey;
+    CKey key;
+
+    CWalletLoadRecord(const std::string& strTypeIn, const CDataStream& ssKeyIn, const CDataStream& ssValueIn)
+        : strType(strTypeIn), ssKey(ssKeyIn), ssValue(ssValueIn), fDecoded(false), fUpgraded(false) {}
+};
+
+static const unsigned int MAX_LOAD_THREADS = 8;
+static const unsigned int LOAD_RECORDS_PER_THREAD = 1000;
+
+static bool IsThreadDecodedType(const string& strType)
+{
+    return (strType == "tx" || strType == "key" || strType == "wkey");
+}
+
+static void ThreadDecodeWalletRecords(std::vector<CWalletLoadRecord>* pvRecords, std::atomic<unsigned int>* pnNext)
+{
+    unsigned int n;
+    while ((n = (*pnNext)++) < pvRecords->size()) {
+        CWalletLoadRecord& rec = (*pvRecords)[n];
+        if (!IsThreadDecodedType(rec.strType))
+            continue;
+        try {
+            string strType;
+            rec.ssKey >> strType;
+            if (strType == "tx")
+                rec.fDecoded = ReadWalletTx(rec.ssKey, rec.ssValue, rec.hash, rec.wtx, rec.fUpgraded, rec.strErr);
+            else
+                rec.fDecoded = ReadWalletKey(strType, rec.ssKey, rec.ssValue, rec.vchPubKey, rec.key, rec.strErr);
+        } catch (...) {
+            rec.fDecoded = false;
+        }
+        // the raw record isn't needed any more
+        rec.ssKey.clear();
+        rec.ssValue.clear();
+    }
+}
+
 static bool IsKeyType(string strType)
 {
     return (strType == "key" || strType == "wkey" ||
@@ -698,6 +770,9 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        int64_t nStart = GetTimeMillis();
+        unsigned int nDecode = 0;
+        std::vector<CWalletLoadRecord> vRecords;
         while (true) {
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -710,25 +785,85 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
+            // Transactions and keys are decoded and checked on the loader threads below, every
+            // record is applied afterwards in cursor order
+            string strType;
+            try {
+                CDataStream ssType(ssKey);
+                ssType >> strType;
+            } catch (...) {
+            }
+            if (IsThreadDecodedType(strType))
+                nDecode++;
+            vRecords.push_back(CWalletLoadRecord(strType, ssKey, ssValue));
+        }
+        pcursor->close();
+        int64_t nRead = GetTimeMillis();
+
+        unsigned int nThreads = std::max(1u, std::min(MAX_LOAD_THREADS, boost::thread::hardware_concurrency()));
+        nThreads = std::min(nThreads, nDecode / LOAD_RECORDS_PER_THREAD + 1);
+        std::atomic<unsigned int> nNext(0);
+        if (nThreads > 1) {
+            boost::thread_group workers;
+            for (unsigned int i = 0; i < nThreads; i++)
+                workers.create_thread(boost::bind(&ThreadDecodeWalletRecords, &vRecords, &nNext));
+            workers.join_all();
+        } else {
+            ThreadDecodeWalletRecords(&vRecords, &nNext);
+        }
+        int64_t nDecoded = GetTimeMillis();
+
+        // Apply in cursor order; spends are indexed in one pass once every transaction is in
+        unsigned int nTx = 0;
+        for (CWalletLoadRecord& rec : vRecords) {
+            if (!IsThreadDecodedType(rec.strType)) {
+                // Try to be tolerant of single corrupt records:
+                string strType;
+                string strErr;
+                if (!ReadKeyValue(pwallet, rec.ssKey, rec.ssValue, wss, strType, strErr)) {
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                    }
+                }
+                if (!strErr.empty())
+                    LogPrintf("%s\n", strErr);
+                continue;
+            }
+
+            if (rec.strType == "key")
+                wss.nKeys++;
+            if (rec.fDecoded && rec.strType == "tx") {
+                if (rec.fUpgraded)
+                    wss.vWalletUpgrade.push_back(rec.hash);
+                if (rec.wtx.nOrderPos == -1)
+                    wss.fAnyUnordered = true;
+                pwallet->LoadWalletTx(rec.wtx);
+                nTx++;
+            } else if (rec.fDecoded && !pwallet->LoadKey(rec.key, rec.vchPubKey)) {
+                rec.strErr = "Error reading wallet database: LoadKey failed";
+                rec.fDecoded = false;
+            }
+            if (!rec.fDecoded) {
+                if (IsKeyType(rec.strType)) {
                     result = DB_CORRUPT;
-                else {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                } else {
+                    fNoncriticalErrors = true;
+                    // Rescan if there is a bad transaction record:
+                    SoftSetBoolArg("-rescan", true);
                 }
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
+            if (!rec.strErr.empty())
+                LogPrintf("%s\n", rec.strErr);
         }
-        pcursor->close();
+        pwallet->RebuildSpends();
+
+        LogPrintf("Wallet load: %u records read in %dms, %u keys and transactions decoded on %u threads in %dms, %u transactions indexed in %dms\n",
+            vRecords.size(), nRead - nStart, nDecode, nThreads, nDecoded - nRead, nTx, GetTimeMillis() - nDecoded);
     } catch (boost::thread_interrupted) {
         throw;
     } catch (...) {